@@ -36,9 +36,29 @@
 // A global variable indicating the number of accelerometers present (TP3)
 static int num_accelerometers = 0;
 
+// Logging on the sample path: dev_dbg, so it also has to be enabled with dynamic debug, and errors
+// there are rate limited, so that the console keeps up with the highest output data rates (TP4)
+static unsigned int verbose;
+module_param(verbose, uint, 0644);
+MODULE_PARM_DESC(verbose, "Sample path logging: 0 none (default), 1 every interrupt and read, 2 every sample");
+
+#define adxl345_dbg(adxl_dev, level, fmt, ...)                                  \
+    do {                                                                        \
+        if (unlikely(READ_ONCE(verbose) >= (level)))                            \
+            dev_dbg((adxl_dev)->miscdev.parent, fmt, ##__VA_ARGS__);            \
+    } while (0)
+
 
 // TP4
 #define ADXL345_REG_FIFO_STATUS 0x39
+#define ADXL345_REG_INT_SOURCE  0x30
+
+#define ADXL345_FIFO_ENTRIES_MASK 0x3F // FIFO_STATUS bits 0-5
+#define ADXL345_FIFO_DEPTH        32
+#define ADXL345_FIFO_WATERMARK    20   // Samples field of FIFO_CTL
+#define ADXL345_FIFO_STREAM_MODE  0x80
+#define ADXL345_INT_WATERMARK     0x02
+#define ADXL345_INT_OVERRUN       0x01
 
 struct fifo_element {
     // Structure representing a sample from the accelerometer
@@ -56,6 +76,16 @@ struct adxl345_device {
     DECLARE_KFIFO(samples_fifo, struct fifo_element, 64); // Arbitrary size, adjust as needed
     // Declare the queue
     wait_queue_head_t wait_queue;
+
+    unsigned long hw_overruns; // Number of times the accelerometer FIFO overflowed
+    unsigned long sw_overruns; // Number of samples lost because samples_fifo was full
+
+    // FIFO drain, only used by the IRQ thread, so that the drain never allocates
+    struct i2c_msg msgs[2 * ADXL345_FIFO_DEPTH];
+    // The adapter may DMA to and from these (I2C_M_DMA_SAFE): each one starts a cache line, and
+    // reg_data comes last so that nothing else shares its lines
+    u8 data_reg ____cacheline_aligned;
+    u8 reg_data[ADXL345_FIFO_DEPTH * 6] ____cacheline_aligned;
 };
 
 
@@ -80,6 +110,56 @@ static long adxl345_ioctl(struct file *file, unsigned int cmd, unsigned long arg
 }
 
 
+// Pop num_samples entries (up to ADXL345_FIFO_DEPTH) from the accelerometer FIFO into adxl_dev->reg_data, 6 bytes per entry
+// Each entry is a write(DATAX0)/read(6) pair joined by a repeated start, and all the pairs of a
+// batch go out in a single i2c_transfer, so the adapter is locked once per batch instead of per entry
+static int adxl345_drain_fifo(struct adxl345_device *adxl_dev, struct i2c_client *client, int num_samples)
+{
+    const struct i2c_adapter_quirks *quirks = client->adapter->quirks;
+    struct i2c_msg *msgs = adxl_dev->msgs;
+    int max_batch = num_samples;
+    int done = 0;
+    int batch;
+    int ret = 0;
+    int i;
+
+    // Some adapters cap the number of messages per transfer
+    if (quirks && quirks->max_num_msgs)
+        max_batch = max(quirks->max_num_msgs / 2, 1);
+
+    adxl_dev->data_reg = ADXL345_DATAX0;
+    while (done < num_samples) {
+        batch = min(max_batch, num_samples - done);
+        for (i = 0; i < batch; i++) {
+            msgs[2 * i].addr = client->addr;
+            msgs[2 * i].flags = (client->flags & I2C_M_TEN) | I2C_M_DMA_SAFE;
+            msgs[2 * i].len = 1;
+            msgs[2 * i].buf = &adxl_dev->data_reg;
+
+            msgs[2 * i + 1].addr = client->addr;
+            msgs[2 * i + 1].flags = (client->flags & I2C_M_TEN) | I2C_M_RD | I2C_M_DMA_SAFE;
+            msgs[2 * i + 1].len = 6;
+            msgs[2 * i + 1].buf = &adxl_dev->reg_data[(done + i) * 6];
+        }
+
+        ret = i2c_transfer(client->adapter, msgs, 2 * batch);
+        if (ret < 0)
+            break;
+        // Only complete write/read pairs hold a valid entry
+        done += ret / 2;
+        if (ret != 2 * batch) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    // Report the entries we did get, they are already gone from the accelerometer FIFO
+    if (done == 0 && ret < 0)
+        return ret;
+    return done;
+}
+
+
 // Function to read data from the accelerometer
 static ssize_t adxl345_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {   
@@ -114,7 +194,7 @@ static ssize_t adxl345_read(struct file *file, char __user *buf, size_t count, l
 
     // Check if data is available in the FIFO, if not, put the process in to wait
     if(kfifo_is_empty(&adxl_dev->samples_fifo))
-        printk("FIFO is empty!!\n");
+        adxl345_dbg(adxl_dev, 1, "FIFO is empty!!\n");
     wait_event_interruptible(adxl_dev->wait_queue, !kfifo_is_empty(&adxl_dev->samples_fifo));
 
     // Data available in the FIFO, retrieve it
@@ -130,7 +210,7 @@ static ssize_t adxl345_read(struct file *file, char __user *buf, size_t count, l
     else if (reg_data_address == 'Z')
         accel_data = sample.z;
     else {
-        pr_err("Wrong axis!!!!!\n");
+        dev_err_ratelimited(&client->dev, "Wrong axis!!!!!\n");
         return -EIO;
         }
 
@@ -152,74 +232,108 @@ static ssize_t adxl345_read(struct file *file, char __user *buf, size_t count, l
 // Write the bottom half function ( adxl345_int for example):
 static irqreturn_t adxl345_int(int irq, void *dev_id)
 {
-    pr_info("This is interupt handle\n");
     struct adxl345_device *adxl_dev = dev_id;
     // Convert the pointer to `adxl_dev->miscdev.parent` into a pointer to `client` (Make adxl_dev->miscdev.parent have type struct i2c_client)
     struct i2c_client *client = to_i2c_client(adxl_dev->miscdev.parent);
 
-    u8 fifo_status_reg = ADXL345_REG_FIFO_STATUS;
-    u8 fifo_status;
+    int int_source;
+    int fifo_status;
+    int num_samples;
     int ret;
+    int i;
 
-    // Read FIFO status register to determine the number of samples available
-    ret = i2c_master_send(client, &fifo_status_reg, 1);
-    if (ret != 1) {
-        pr_err("Failed to send command to read FIFO status\n");
-        return ret; // or appropriate error handling
-    }
-    ret = i2c_master_recv(client, &fifo_status, 1);
-    if (ret != 1) {
-        pr_err("Failed to read FIFO status\n");
-        return ret; // or appropriate error handling
-    }
-
-    // Check FIFO status to determine the number of samples available
-    int num_samples = fifo_status & 0x1F; // Bits 0-4 represent the number of samples
-    pr_info("Number of samples available in FIFO: %d\n", num_samples);
+    adxl345_dbg(adxl_dev, 1, "This is interupt handle\n");
 
-    // Read samples from the accelerometer FIFO
-    u8 reg_data_address[] = {ADXL345_DATAX0, ADXL345_DATAX1, ADXL345_DATAY0, ADXL345_DATAY1, ADXL345_DATAZ0, ADXL345_DATAZ1};
-    i2c_master_send(client, reg_data_address, 6);
+    // The watermark line stays asserted as long as the FIFO holds at least ADXL345_FIFO_WATERMARK entries,
+    // and new samples keep arriving while we read, so drain in a loop instead of a single pass
+    do {
+        // The overrun bit is cleared by reading the data registers, so sample it before draining
+        int_source = i2c_smbus_read_byte_data(client, ADXL345_REG_INT_SOURCE);
+        if (int_source < 0) {
+            dev_err_ratelimited(&client->dev, "Failed to read INT_SOURCE\n");
+            break;
+        }
+        if (int_source & ADXL345_INT_OVERRUN)
+            adxl_dev->hw_overruns++;
 
-    // Allocate memory for reg_data dynamically
-    int num_byte_read = num_samples * 3 * 2 * sizeof(u8); // Each sample contains 2 bytes of data from 3 axis
-    u8 *reg_data = kmalloc(num_byte_read, GFP_KERNEL);
-    if (!reg_data) {
-        pr_err("Failed to allocate memory for reg_data\n");
-        return IRQ_HANDLED; // or appropriate error handling
-    }
+        // Read FIFO status register to determine the number of samples available
+        fifo_status = i2c_smbus_read_byte_data(client, ADXL345_REG_FIFO_STATUS);
+        if (fifo_status < 0) {
+            dev_err_ratelimited(&client->dev, "Failed to read FIFO status\n");
+            break;
+        }
 
-    // Retrieve all samples from the accelerometer FIFO
-    i2c_master_recv(client, reg_data, num_byte_read);
-    int i;
-    for (i = 0; i < num_byte_read; i += 6) { // Travel through each sample by increasing the index by 6 (bytes) each time
-        struct fifo_element sample;
-        // Get X-axis data from reg_data
-        sample.x = (s16)(reg_data[i + 1] << 8) | reg_data[i];
-        // Get Y-axis data from reg_data
-        sample.y = (s16)(reg_data[i + 3] << 8) | reg_data[i + 2];
-        // Get Z-axis data from reg_data
-        sample.z = (s16)(reg_data[i + 5] << 8) | reg_data[i + 4];
-
-        printk("FIFO's data of %d sample is: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n", i/6, reg_data[i], reg_data[i + 1], reg_data[i + 2], reg_data[i + 3],
-        reg_data[i + 4], reg_data[i + 5]);
-
-        ret = kfifo_put(&adxl_dev->samples_fifo, sample);
-    }
+        // Check FIFO status to determine the number of samples available
+        num_samples = min_t(int, fifo_status & ADXL345_FIFO_ENTRIES_MASK, ADXL345_FIFO_DEPTH); // Bits 0-5 represent the number of samples (up to 32)
+        adxl345_dbg(adxl_dev, 1, "Number of samples available in FIFO: %d\n", num_samples);
+        if (num_samples == 0)
+            break;
 
-    // Free the dynamic array
-    kfree(reg_data);
+        // The entries go to the buffer of the device, no allocation per pass
+        int num_byte_read; // Each sample contains 2 bytes of data from 3 axis
+        u8 *reg_data = adxl_dev->reg_data;
+
+        // Each multi-byte read of DATAX0..DATAZ1 pops exactly one entry from the accelerometer FIFO
+        ret = adxl345_drain_fifo(adxl_dev, client, num_samples);
+        if (ret != num_samples)
+            dev_err_ratelimited(&client->dev, "Failed to read FIFO entries (%d/%d)\n", ret, num_samples);
+        num_byte_read = ret > 0 ? ret * 6 : 0;
+
+        for (i = 0; i < num_byte_read; i += 6) { // Travel through each sample by increasing the index by 6 (bytes) each time
+            struct fifo_element sample;
+            // Get X-axis data from reg_data
+            sample.x = (s16)(reg_data[i + 1] << 8) | reg_data[i];
+            // Get Y-axis data from reg_data
+            sample.y = (s16)(reg_data[i + 3] << 8) | reg_data[i + 2];
+            // Get Z-axis data from reg_data
+            sample.z = (s16)(reg_data[i + 5] << 8) | reg_data[i + 4];
+
+            adxl345_dbg(adxl_dev, 2, "FIFO's data of %d sample is: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n", i/6, reg_data[i], reg_data[i + 1], reg_data[i + 2], reg_data[i + 3],
+            reg_data[i + 4], reg_data[i + 5]);
+
+            // The software FIFO is full: the sample is lost, count it
+            if (!kfifo_put(&adxl_dev->samples_fifo, sample))
+                adxl_dev->sw_overruns++;
+        }
 
-    // Wake up processes waiting for data
-    wake_up_interruptible(&adxl_dev->wait_queue);
+        // Wake up processes waiting for data
+        wake_up_interruptible(&adxl_dev->wait_queue);
 
-    // Delay for 10 seconds (10000 milliseconds)
-    msleep(10000);
+        // A short read means the bus failed, don't spin on it
+        if (num_byte_read != num_samples * 6)
+            break;
+    } while (num_samples >= ADXL345_FIFO_WATERMARK);
 
     return IRQ_HANDLED;
 }
 
 
+// Overrun counters, exported in /sys/class/misc/adxl345-N/ so that loss can be checked under load
+static ssize_t overruns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct miscdevice *miscdev = dev_get_drvdata(dev);
+    struct adxl345_device *adxl_dev = container_of(miscdev, struct adxl345_device, miscdev);
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(adxl_dev->hw_overruns));
+}
+static DEVICE_ATTR_RO(overruns);
+
+static ssize_t dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct miscdevice *miscdev = dev_get_drvdata(dev);
+    struct adxl345_device *adxl_dev = container_of(miscdev, struct adxl345_device, miscdev);
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(adxl_dev->sw_overruns));
+}
+static DEVICE_ATTR_RO(dropped);
+
+static struct attribute *adxl345_attrs[] = {
+    &dev_attr_overruns.attr,
+    &dev_attr_dropped.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(adxl345);
+
 
 
 static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *id)
@@ -272,6 +386,10 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
     if (!adxl345_dev)
         return -ENOMEM; //Out of Memory error
 
+    // Initialize FIFO and queue before anything (reader or interrupt) can use them
+    INIT_KFIFO(adxl345_dev->samples_fifo);
+    init_waitqueue_head(&adxl345_dev->wait_queue);
+
     // Associate this instance with the struct i2c_client
     adxl345_dev->miscdev.parent = &client->dev;
 
@@ -292,6 +410,7 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
     adxl345_dev->miscdev.minor = MISC_DYNAMIC_MINOR; // dynamically assign a minor number
     adxl345_dev->miscdev.name = name;
     adxl345_dev->miscdev.fops = &adxl345_fops; // No fops at the moment
+    adxl345_dev->miscdev.groups = adxl345_groups; // overruns and dropped counters
 
     // Register with the misc framework
     ret = misc_register(&adxl345_dev->miscdev);
@@ -310,18 +429,9 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
     pr_info("Successfully registered %s\n", adxl345_dev->miscdev.name);
     /////////////////////////// TP4 ///////////////////////////
     // Configure the accelerometer correctly (registers INT_ENABLE and FIFO_CTL)
-    // Enable Watermark interrupt in INT_ENABLE register
-    reg_data[0] = ADXL345_REG_INT_ENABLE;
-    reg_data[1] = 0x02; //1 << 2; // Watermark interrupt bit (00000010)
-    ret = i2c_master_send(client, reg_data, 2);
-    if (ret != 2) {
-        pr_err("Failed to enable Watermark interrupt\n");
-        return ret;
-    }
-
     // Configure FIFO_CTL register to enable FIFO mode and set watermark level to 20
     reg_data[0] = ADXL345_REG_FIFO_CTL;
-    reg_data[1] = 0x94; //(1 << 7) | 20; // FIFO Stream mode enabled, watermark level set to 20 (10000000 OR 00010100)
+    reg_data[1] = ADXL345_FIFO_STREAM_MODE | ADXL345_FIFO_WATERMARK; // FIFO Stream mode enabled, watermark level set to 20 (10000000 OR 00010100)
     ret = i2c_master_send(client, reg_data, 2);
     if (ret != 2) {
         pr_err("Failed to configure FIFO_CTL register\n");
@@ -335,12 +445,15 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
         return ret;
     }
 
-    // Initialize FIFO
-    INIT_KFIFO(adxl345_dev->samples_fifo);
+    // Enable Watermark interrupt in INT_ENABLE register, only now that the handler is there to drain the FIFO
+    reg_data[0] = ADXL345_REG_INT_ENABLE;
+    reg_data[1] = ADXL345_INT_WATERMARK; // Watermark interrupt bit (00000010)
+    ret = i2c_master_send(client, reg_data, 2);
+    if (ret != 2) {
+        pr_err("Failed to enable Watermark interrupt\n");
+        return ret;
+    }
 
-    // Initialize the queue
-    init_waitqueue_head(&adxl345_dev->wait_queue);
-    
     pr_info("Successfully probe TP4\n");
 
     return 0;
@@ -356,11 +469,10 @@ static int adxl345_remove(struct i2c_client *client)
     reg_data[0] = ADXL345_REG_POWER_CTL;
     reg_data[1] = ADXL345_STANDBY_MODE;
 
+    // The device gets unbound whatever is returned, so a failure must not skip the teardown below
     ret = i2c_master_send(client, reg_data, 2);
-    if (ret != 2){
-        printk("Failed to switch to standby mode !!\n");
-        return ret;
-    }
+    if (ret != 2)
+        dev_err(&client->dev, "Failed to switch to standby mode: %d\n", ret);
 
     // TP3
     // Retrieve the instance of the struct adxl345_device from the struct i2c_client retrieved as argument
@@ -368,6 +480,10 @@ static int adxl345_remove(struct i2c_client *client)
     // Unregister from the misc framework
     misc_deregister(&adxl345_dev->miscdev);
 
+    // The IRQ is device-managed and would only be released after this function returns,
+    // free it now so that the handler cannot run on the freed instance
+    devm_free_irq(&client->dev, client->irq, adxl345_dev);
+
     // Decrement the number of accelerometers
     num_accelerometers--;
 
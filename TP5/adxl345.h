@@ -0,0 +1,109 @@
+// Definitions shared between the adxl345 driver and the applications using /dev/adxl345-N (TP5)
+#ifndef ADXL345_H
+#define ADXL345_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// Custom IOCTL commands (TP3 - part3)
+#define ADXL_IOCTL_SET_AXIS_X _IO('X', 0)
+#define ADXL_IOCTL_SET_AXIS_Y _IO('Y', 1)
+#define ADXL_IOCTL_SET_AXIS_Z _IO('Z', 2)
+// read() returns whole struct fifo_element records instead of a single axis (TP5)
+#define ADXL_IOCTL_SET_AXIS_ALL _IO('A', 3)
+// read() blocks and poll() reports the device readable only once this many samples are queued (TP5)
+#define ADXL_IOCTL_SET_LOWAT _IOW('A', 4, __u32)
+// Number of samples this file missed because it read them too late (TP5)
+#define ADXL_IOCTL_GET_OVERRUNS _IOR('A', 5, __u64)
+
+// Runtime configuration of the accelerometer, shared by every file of the device (TP5)
+// Also available one field at a time in /sys/class/misc/adxl345-N/
+struct adxl345_config {
+    __u32 odr_mhz;    // Output data rate in mHz (100 to 3200000), rounded down to one the device supports
+    __u8 range_g;     // Measurement range: 2, 4, 8 or 16 g
+    __u8 full_res;    // 1: 4 mg/LSB at every range, 0: 10-bit samples scaled to the range
+    __u8 watermark;   // Samples per interrupt, 1 to 31
+    __u8 reserved;
+};
+#define ADXL_IOCTL_GET_CONFIG _IOR('A', 6, struct adxl345_config)
+// SET_CONFIG also restarts the interrupt after the driver gave up on a failing bus (irq_off in the debugfs stats)
+#define ADXL_IOCTL_SET_CONFIG _IOW('A', 7, struct adxl345_config)
+// Let the driver pick the watermark so that a sample reaches its readers within this many us,
+// batching as much as the budget allows. It then overrides the watermark of the configuration,
+// 0 goes back to a fixed one (TP5)
+#define ADXL_IOCTL_SET_LATENCY _IOW('A', 8, __u32)
+
+// Output format of read(), for this file only: any set of axes in one of the layouts below (TP5)
+// Each sample gives the selected axes in x, y, z order, samples are contiguous in the buffer.
+// ADXL_IOCTL_SET_AXIS_X is { ADXL345_AXIS_X, ADXL345_LAYOUT_S16 }, ADXL_IOCTL_SET_AXIS_ALL is
+// { ADXL345_AXIS_ALL, ADXL345_LAYOUT_RECORD }.
+#define ADXL345_AXIS_X   0x1
+#define ADXL345_AXIS_Y   0x2
+#define ADXL345_AXIS_Z   0x4
+#define ADXL345_AXIS_ALL 0x7
+
+#define ADXL345_LAYOUT_S16        0 // __s16 per axis as in the ring, packed: 2, 4 or 6 bytes per sample
+#define ADXL345_LAYOUT_S16_PADDED 1 // __s16 per axis as in the ring, zero padded to 2, 4 or 8 bytes per sample
+#define ADXL345_LAYOUT_S32_MG     2 // __s32 per axis, in mg
+#define ADXL345_LAYOUT_RECORD     3 // Whole struct fifo_element, the axis mask is ignored
+
+struct adxl345_format {
+    __u8 axes;    // ADXL345_AXIS_* ored together, at least one
+    __u8 layout;  // ADXL345_LAYOUT_*
+    __u16 reserved;
+};
+#define ADXL_IOCTL_SET_FORMAT _IOW('A', 9, struct adxl345_format)
+
+// Self-calibration: the board lies flat and still, Z up. The driver averages samples samples, then
+// programs the offset registers of the accelerometer so that X and Y read 0 and Z +1 g, and returns
+// them in offset (15.6 mg/LSB). The samples used are not given to the readers (TP5)
+// The device is busy meanwhile, so the run must fit in 15 s at the current output data rate (EINVAL
+// otherwise), and a signal interrupts it (EINTR).
+struct adxl345_calibration {
+    __u32 samples;    // 1 to 1024
+    __s8 offset[3];   // x, y, z
+    __u8 reserved;
+};
+#define ADXL_IOCTL_CALIBRATE _IOWR('A', 10, struct adxl345_calibration)
+
+// Consumer slot of this file in the mapped ring header: its position goes to tails[slot] (TP5)
+// The first call picks a free slot and sets its tail to head, the file keeps it until it is closed.
+// poll() on the file then reports it readable once head - tails[slot] reaches its lowat.
+// EBUSY when all ADXL345_RING_SLOTS are taken.
+#define ADXL_IOCTL_RING_SLOT _IOR('A', 11, __u32)
+
+struct fifo_element {
+    // Structure representing a sample from the accelerometer
+    // In LSB, after the calibration of /sys/class/misc/adxl345-N/calib_*, or in mg when calib_mg is 1
+    __s16 x;
+    __s16 y;
+    __s16 z;
+    __u16 reserved;
+    // CLOCK_BOOTTIME at which the sample was acquired, in ns, interpolated from the watermark interrupt (TP5)
+    __u64 timestamp;
+};
+
+// Header of the sample ring mapped with mmap() on /dev/adxl345-N (TP5)
+// It sits at the start of the mapping and the records (struct fifo_element) start at data_offset.
+// head and the tails are free running, a record lives at index & (size - 1).
+// The ring is broadcast: the driver never waits for its consumers (read() and mmap() alike), it
+// may already be writing up to ADXL345_RING_GUARD records past head. A consumer is only safe while
+// head - tail <= size - ADXL345_RING_GUARD, it must check this again after copying records out,
+// and resynchronize (losing the oldest records) when it fell behind.
+// With the drop-newest policy (/sys/class/misc/adxl345-N/drop_policy) the driver instead stops at the
+// slowest consumer and counts the samples it threw away in dropped. A file only counts as a consumer
+// once it called read() or got a slot with ADXL_IOCTL_RING_SLOT: a mapping then publishes its tail
+// in tails[slot] after each copy.
+#define ADXL345_RING_SLOTS 64 // Mapping consumers with their own tail
+
+struct adxl345_ring {
+    __u32 head;        // Producer index, written by the driver once the records are in place
+    __u32 size;        // Number of records, power of 2
+    __u32 data_offset; // Offset in bytes of the first record from the start of the mapping
+    __u32 dropped;     // Number of samples the driver could not store (drop-newest policy)
+    __u32 tails[ADXL345_RING_SLOTS]; // Consumer indexes, each owned by the file holding the slot
+};
+
+#define ADXL345_RING_GUARD 32 // The accelerometer FIFO depth, the largest batch the driver publishes at once
+
+#endif
@@ -4,10 +4,22 @@
 #include <linux/of.h>
 #include <linux/i2c.h>
 #include <linux/miscdevice.h>
-#include <linux/kfifo.h>
 #include <linux/wait.h>
 #include <linux/delay.h>
 #include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/sched/signal.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/regmap.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "adxl345.h"
+
+#define CREATE_TRACE_POINTS
+#include "adxl345_trace.h"
 
 
 
@@ -37,195 +49,1671 @@
 // A global variable indicating the number of accelerometers present (TP3)
 static int num_accelerometers = 0;
 
+// Size of the sample ring of every new device, changed per device in /sys/class/misc/adxl345-N/ring_size (TP5)
+static unsigned int ring_size;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Records in the sample ring, power of 2 from 64 to 1048576, 0 to follow the output data rate (default)");
+
+static bool drop_newest;
+module_param(drop_newest, bool, 0444);
+MODULE_PARM_DESC(drop_newest, "When a reader falls behind, drop the new samples instead of overwriting its oldest ones");
+
+static unsigned int calibrate;
+module_param(calibrate, uint, 0444);
+MODULE_PARM_DESC(calibrate, "Self-calibrate at probe from this many samples, the board lying flat with Z up, 0 not to (default)");
+
+// Logging on the sample path (TP5)
+// The messages are dev_dbg: they also have to be enabled with dynamic debug, and they are compiled
+// out of kernels that have neither it nor DEBUG. Errors there are rate limited.
+static unsigned int verbose;
+module_param(verbose, uint, 0644);
+MODULE_PARM_DESC(verbose, "Sample path logging: 0 none (default), 1 every interrupt and read, 2 every sample");
+
+#define adxl345_dbg(adxl_dev, level, fmt, ...)                                  \
+    do {                                                                        \
+        if (unlikely(READ_ONCE(verbose) >= (level)))                            \
+            dev_dbg((adxl_dev)->miscdev.parent, fmt, ##__VA_ARGS__);            \
+    } while (0)
+
 
 // TP4
 #define ADXL345_REG_FIFO_STATUS 0x39
+#define ADXL345_REG_INT_SOURCE  0x30
 
-struct fifo_element {
-    // Structure representing a sample from the accelerometer
-    s16 x;
-    s16 y;
-    s16 z;
-};
+#define ADXL345_FIFO_ENTRIES_MASK 0x3F // FIFO_STATUS bits 0-5
+#define ADXL345_FIFO_DEPTH        32
+#define ADXL345_FIFO_WATERMARK    20   // Samples field of FIFO_CTL
+#define ADXL345_FIFO_STREAM_MODE  0x80
+#define ADXL345_INT_WATERMARK     0x02
+#define ADXL345_INT_OVERRUN       0x01
+#define ADXL345_MAX_FAILURES      8    // Drain attempts of an interrupt before the line is disabled (TP5)
+
+// TP5
+#define ADXL345_RING_SIZE    1024 // Minimum number of records in the sample ring, power of 2
+#define ADXL345_RING_SECONDS 2    // The ring is sized to hold about this long of samples at the current rate
+#define ADXL345_RING_MIN     (2 * ADXL345_RING_GUARD) // Bounds of a ring size chosen by the user
+#define ADXL345_RING_MAX     (1 << 20)                // 16 MB of records
+
+#define ADXL345_DATA_FORMAT_FULL_RES   0x08
+#define ADXL345_DATA_FORMAT_RANGE_MASK 0x03 // 0: +/-2g, 1: +/-4g, 2: +/-8g, 3: +/-16g
+
+#define ADXL345_REG_OFSX 0x1E // Offsets added by the accelerometer to each axis, s8 at 15.6 mg/LSB
+#define ADXL345_REG_OFSY 0x1F
+#define ADXL345_REG_OFSZ 0x20
+#define ADXL345_CALIB_ONE (1 << 16) // 1.0 in the software gain matrix
+#define ADXL345_OFS_MG_X10 156      // Scale of the offset registers, in tenths of mg per LSB
+#define ADXL345_CALIB_MAX_SAMPLES 1024
+#define ADXL345_CALIB_MAX_MS      15000 // Longest self-calibration, the configuration lock is held meanwhile
 
 
 
 // Declare a struct adxl345_device structure containing for the moment a single struct miscdevice field (TP3)
 struct adxl345_device {
     struct miscdevice miscdev;
-    // Create FIFO to store samples (TP4)
-    DECLARE_KFIFO(samples_fifo, struct fifo_element, 64); // Arbitrary size, adjust as needed
+    // Open files and mappings keep the device alive after adxl345_remove, which marks it dead (TP5)
+    struct kref kref;
+    bool dead;
+    struct regmap *regmap; // All register traffic but the FIFO drain (TP5)
     // Declare the queue
     wait_queue_head_t wait_queue;
+    unsigned int lowat; // Lowest lowat of the open files: readers are only woken up once this many samples are queued (TP5)
+    u32 wake_head;      // ring_head at the last wake up
+
+    // Configuration, changed at runtime with the IRQ disabled (TP5)
+    int irq;
+    bool irq_off;               // The IRQ thread gave up and disabled the line, enabled again by SET_CONFIG
+    u8 bw_rate;                 // Value written to BW_RATE, gives the sample period
+    u8 data_format;             // Value written to DATA_FORMAT
+    u8 watermark;               // Samples field written to FIFO_CTL
+    u32 latency_us;             // Latency budget of the adaptive watermark, 0 when the watermark is fixed
+    u64 drain_ns;               // Average time from the interrupt to the end of the drain
+
+    // Timestamps (TP5)
+    u64 irq_timestamp;          // CLOCK_BOOTTIME of the last watermark interrupt, in ns
+    u64 next_timestamp;         // Due to the next FIFO entry, 0 when unknown: at start or after the FIFO was reset
+
+    unsigned long hw_overruns;  // Number of times the accelerometer FIFO overflowed
+    atomic_long_t sw_overruns;  // Number of samples lost in the ring: overwritten before a reader got them, summed
+                                // over the readers, or never stored with the drop-newest policy
+
+    struct mutex lock; // Protects the configuration and the list of open files, never taken on the read path (TP5)
+    struct list_head files;
+    spinlock_t files_lock; // Also protects the list, for the IRQ thread looking for the slowest reader
+
+    // Sample ring: the IRQ thread is the only producer, every open file and mapping has its own cursor (TP5)
+    struct adxl345_ring *ring;       // Header page, followed by the records, also mapped by user space
+    struct fifo_element *ring_data;  // First record
+    size_t ring_bytes;               // Size of the whole mapping
+    u32 ring_size;                   // Private copies, the mapped header can be scribbled on by user space
+    u32 ring_head;
+    atomic_t ring_mappers;           // Number of VMAs mapping the ring, it can't be resized while mapped
+    DECLARE_BITMAP(ring_slots, ADXL345_RING_SLOTS); // Taken slots of ring->tails, under lock
+    u32 ring_request;                // Size asked for by the user, 0 to follow the output data rate
+    bool drop_newest;                // Never overwrite a record a reader still needs, drop the new ones instead
+
+    // Software calibration applied in the drain, changed with the IRQ disabled (TP5)
+    // sample = gain * raw / ADXL345_CALIB_ONE + offset, then converted to mg if asked for
+    struct {
+        s32 gain[3][3];
+        s32 offset[3];      // In LSB
+        bool mg;            // The ring holds mg instead of LSB
+        bool active;        // Anything but the identity, else the drain skips it
+    } calib;
+
+    // Statistics, shown in /sys/kernel/debug/adxl345-N/stats. Only the IRQ thread writes them but delivered (TP5)
+    struct dentry *debugfs;
+    unsigned long irqs;                 // Interrupts handled
+    unsigned long hw_samples;           // Entries read from the accelerometer FIFO
+    atomic_long_t delivered;            // Samples read() returned, summed over the files
+    unsigned long i2c_errors;           // Failed register reads and drains
+    unsigned long drains;               // I2C bursts, and their duration
+    u64 drain_min_ns;
+    u64 drain_max_ns;
+    u64 drain_total_ns;
+    unsigned long entries_hist[ADXL345_FIFO_DEPTH + 1]; // Number of drains by FIFO entries found
+
+    // FIFO drain, only used by the IRQ thread: allocated with the device so the drain never allocates (TP5)
+    struct i2c_msg msgs[2 * ADXL345_FIFO_DEPTH];
+    // The adapter may DMA to and from these (I2C_M_DMA_SAFE), so each one starts a cache line and
+    // nothing else shares its lines: reg_data comes last, and the structure is padded to a whole
+    // number of cache lines, which kmalloc aligns
+    u8 data_reg ____cacheline_aligned;
+    u8 reg_data[ADXL345_FIFO_DEPTH * 6] ____cacheline_aligned;
+};
+
+
+// The data and status registers change on their own, everything else is configuration (TP5)
+static bool adxl345_volatile_reg(struct device *dev, unsigned int reg)
+{
+    switch (reg) {
+        case ADXL345_REG_INT_SOURCE:
+        case ADXL345_DATAX0 ... ADXL345_DATAZ1:
+        case ADXL345_REG_FIFO_STATUS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The configuration registers are cached: reading them back never touches the bus (TP5)
+// No defaults are given, the device may have been configured by a previous load of the module, so
+// the cache is filled by the probe-time writes.
+static const struct regmap_config adxl345_regmap_config = {
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = ADXL345_REG_FIFO_STATUS,
+    .volatile_reg = adxl345_volatile_reg,
+    .cache_type = REGCACHE_FLAT,
+};
+
+// Write a configuration register, skipped when the cached value is already the right one (TP5)
+static int adxl345_write_reg(struct adxl345_device *adxl_dev, unsigned int reg, unsigned int val)
+{
+    return regmap_update_bits(adxl_dev->regmap, reg, 0xFF, val);
+}
+
+// Per-open-file state, so that independent readers of the same sensor don't step on each other (TP5)
+// Every file has its own cursor in the sample ring, so all of them see every sample
+struct adxl345_file {
+    struct adxl345_device *adxl_dev;
+    struct list_head node;              // In adxl_dev->files
+    u16 format;                         // Output format of read(): ADXL345_AXIS_* | ADXL345_LAYOUT_* << 8
+    unsigned int lowat;                 // Wake up once this many samples are queued
+    u32 cursor;                         // Ring index of the next sample to return, released once the samples are copied out
+    bool reading;                       // read() was called: only then does the cursor hold the producer back
+    int slot;                           // Index in ring->tails of the mapping consumer of this file, -1 if none
+    u64 overruns;                       // Samples overwritten before this file read them
+    struct mutex read_lock;             // Only serializes threads sharing this file
+    struct fifo_element samples[32];    // Samples copied out of the ring, not yet copied to the application
+    u8 out[32 * 3 * sizeof(s32)] __aligned(8); // The same samples in the output format
+};
+
+#define ADXL345_FORMAT(axes, layout) ((axes) | (layout) << 8)
+
+// Lowest lowat of the open files, the IRQ thread wakes readers up once it is reached (TP5)
+static void adxl345_update_lowat(struct adxl345_device *adxl_dev)
+{
+    struct adxl345_file *pf;
+    unsigned int lowat = UINT_MAX;
+
+    lockdep_assert_held(&adxl_dev->lock);
+
+    list_for_each_entry(pf, &adxl_dev->files, node)
+        lowat = min(lowat, pf->lowat);
+    WRITE_ONCE(adxl_dev->lowat, lowat == UINT_MAX ? 1 : lowat);
+}
+
+// Last reference gone: no file, mapping or bound I2C device uses the instance any more (TP5)
+static void adxl345_free(struct kref *kref)
+{
+    struct adxl345_device *adxl_dev = container_of(kref, struct adxl345_device, kref);
+
+    vfree(adxl_dev->ring);
+    kfree(adxl_dev->miscdev.name);
+    kfree(adxl_dev);
+}
+
+static int adxl345_open(struct inode *inode, struct file *file)
+{
+    // misc_open() leaves the miscdevice in private_data
+    struct adxl345_device *adxl_dev = container_of(file->private_data, struct adxl345_device, miscdev);
+    struct adxl345_file *pf;
+
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+
+    // misc_open() runs under the lock of misc_deregister(), so the device is still bound here
+    kref_get(&adxl_dev->kref);
+    pf->adxl_dev = adxl_dev;
+    pf->format = ADXL345_FORMAT(ADXL345_AXIS_X, ADXL345_LAYOUT_S16);  // Default axis is X
+    pf->lowat = 1;
+    pf->slot = -1;
+    mutex_init(&pf->read_lock);
+
+    mutex_lock(&adxl_dev->lock);
+    // A new reader only gets the samples acquired from now on
+    pf->cursor = smp_load_acquire(&adxl_dev->ring_head);
+    spin_lock(&adxl_dev->files_lock);
+    list_add_tail(&pf->node, &adxl_dev->files);
+    spin_unlock(&adxl_dev->files_lock);
+    adxl345_update_lowat(adxl_dev);
+    mutex_unlock(&adxl_dev->lock);
+
+    file->private_data = pf;
+    return 0;
+}
+
+static int adxl345_release(struct inode *inode, struct file *file)
+{
+    struct adxl345_file *pf = file->private_data;
+    struct adxl345_device *adxl_dev = pf->adxl_dev;
+
+    mutex_lock(&adxl_dev->lock);
+    spin_lock(&adxl_dev->files_lock);
+    list_del(&pf->node);
+    spin_unlock(&adxl_dev->files_lock);
+    adxl345_update_lowat(adxl_dev);
+    // The mappings hold the file, none of them is left to publish in the slot
+    if (pf->slot >= 0)
+        clear_bit(pf->slot, adxl_dev->ring_slots);
+    mutex_unlock(&adxl_dev->lock);
+
+    kfree(pf);
+    kref_put(&adxl_dev->kref, adxl345_free);
+    return 0;
+}
+
+// Sample period in ns for a BW_RATE rate code: 3200 Hz for 0xF, halved by each step below (TP5)
+static u64 adxl345_period_ns(u8 bw_rate)
+{
+    return 312500ULL << (0xF - (bw_rate & 0xF));
+}
+
+// Nominal output data rates of the BW_RATE rate codes, in mHz (TP5)
+static const u32 adxl345_odr_mhz[16] = {
+    100, 200, 390, 780, 1560, 3130, 6250, 12500,
+    25000, 50000, 100000, 200000, 400000, 800000, 1600000, 3200000,
+};
+
+// Highest rate code not above odr_mhz, 0.1 Hz at least (TP5)
+static u8 adxl345_rate_code(u32 odr_mhz)
+{
+    u8 rate;
+
+    for (rate = 0xF; rate > 0; rate--)
+        if (adxl345_odr_mhz[rate] <= odr_mhz)
+            break;
+    return rate;
+}
+
+// Number of records of the ring: the size the user asked for, or about ADXL345_RING_SECONDS of samples at this rate (TP5)
+static u32 adxl345_ring_size_for(struct adxl345_device *adxl_dev, u8 bw_rate)
+{
+    u64 n = div64_u64((u64)ADXL345_RING_SECONDS * NSEC_PER_SEC, adxl345_period_ns(bw_rate));
+
+    if (adxl_dev->ring_request)
+        return adxl_dev->ring_request;
+    return roundup_pow_of_two(max_t(u64, n, ADXL345_RING_SIZE));
+}
+
+// A ring size the user may ask for, 0 meaning the default (TP5)
+static bool adxl345_ring_size_valid(u32 size)
+{
+    return size == 0 || (is_power_of_2(size) && size >= ADXL345_RING_MIN && size <= ADXL345_RING_MAX);
+}
+
+// Allocate an empty sample ring of size records: one header page followed by the page-aligned records (TP5)
+static struct adxl345_ring *adxl345_ring_create(u32 size, u32 head, size_t *bytes)
+{
+    struct adxl345_ring *ring;
+    int i;
+
+    *bytes = PAGE_SIZE + PAGE_ALIGN(size * sizeof(struct fifo_element));
+
+    // vmalloc_user zeroes the memory and makes it suitable for remap_vmalloc_range
+    ring = vmalloc_user(*bytes);
+    if (!ring)
+        return NULL;
+
+    ring->head = head;
+    for (i = 0; i < ADXL345_RING_SLOTS; i++)
+        ring->tails[i] = head;
+    ring->size = size;
+    ring->data_offset = PAGE_SIZE;
+    return ring;
+}
+
+// Allocate the sample ring of the device at probe time (TP5)
+static int adxl345_ring_alloc(struct adxl345_device *adxl_dev)
+{
+    adxl_dev->ring_size = adxl345_ring_size_for(adxl_dev, adxl_dev->bw_rate);
+    adxl_dev->ring = adxl345_ring_create(adxl_dev->ring_size, 0, &adxl_dev->ring_bytes);
+    if (!adxl_dev->ring)
+        return -ENOMEM;
+
+    adxl_dev->ring_data = (struct fifo_element *)((u8 *)adxl_dev->ring + PAGE_SIZE);
+    atomic_set(&adxl_dev->ring_mappers, 0);
+
+    return 0;
+}
+
+// Replace the sample ring by an empty one of size records (TP5)
+// Only done while nobody else can be reading the ring: it isn't mapped, no file has a ring slot, and
+// the only open file is the caller (NULL from sysfs, then no file at all), whose read_lock is held.
+// Returns -EBUSY otherwise.
+static int adxl345_ring_resize(struct adxl345_device *adxl_dev, u32 size, struct adxl345_file *caller)
+{
+    struct adxl345_ring *ring;
+    struct adxl345_ring *old;
+    size_t bytes;
+
+    lockdep_assert_held(&adxl_dev->lock);
+
+    if (size == adxl_dev->ring_size)
+        return 0;
+    // A file with a ring slot may poll the header at any time, even with its mapping gone
+    if (atomic_read(&adxl_dev->ring_mappers) || !bitmap_empty(adxl_dev->ring_slots, ADXL345_RING_SLOTS) ||
+        (caller ? !list_is_singular(&adxl_dev->files) : !list_empty(&adxl_dev->files)))
+        return -EBUSY;
+
+    ring = adxl345_ring_create(size, adxl_dev->ring_head, &bytes);
+    if (!ring)
+        return -ENOMEM;
+
+    // Stop the producer while the ring is swapped
+    disable_irq(adxl_dev->irq);
+    old = adxl_dev->ring;
+    ring->dropped = old->dropped;
+    adxl_dev->ring = ring;
+    adxl_dev->ring_data = (struct fifo_element *)((u8 *)ring + PAGE_SIZE);
+    adxl_dev->ring_bytes = bytes;
+    adxl_dev->ring_size = size;
+    if (caller) {
+        caller->cursor = adxl_dev->ring_head;
+        caller->lowat = min(caller->lowat, size - ADXL345_RING_GUARD);
+        adxl345_update_lowat(adxl_dev);
+    }
+    enable_irq(adxl_dev->irq);
+
+    vfree(old);
+    return 0;
+}
+
+// Store one sample in the ring, the IRQ thread is the only producer (TP5)
+// It only becomes visible to the readers with adxl345_ring_publish
+static void adxl345_ring_put(struct adxl345_device *adxl_dev, const struct fifo_element *sample, u32 pos)
+{
+    adxl_dev->ring_data[(adxl_dev->ring_head + pos) & (adxl_dev->ring_size - 1)] = *sample;
+}
+
+// Number of samples the slowest reader, file or mapping, has not read yet (TP5)
+// Files that never called read() don't count, e.g. one only kept open for the mapping or the
+// ioctls: their cursor would stay at the open-time head. Mappings count through the tail of their
+// slot in the mapped header, and a tail that makes no sense is ignored.
+static u32 adxl345_ring_used(struct adxl345_device *adxl_dev)
+{
+    u32 usable = adxl_dev->ring_size - ADXL345_RING_GUARD;
+    u32 head = adxl_dev->ring_head;
+    struct adxl345_file *pf;
+    u32 used = 0;
+    u32 tail;
+    int slot;
+
+    spin_lock(&adxl_dev->files_lock);
+    list_for_each_entry(pf, &adxl_dev->files, node) {
+        // Pairs with the release in adxl345_ring_get: the reader is done with the records before its cursor
+        if (READ_ONCE(pf->reading))
+            used = max(used, head - smp_load_acquire(&pf->cursor));
+        // Pairs with the release in adxl345_ring_slot: the tail is set before the slot shows up
+        slot = smp_load_acquire(&pf->slot);
+        if (slot >= 0) {
+            tail = smp_load_acquire(&adxl_dev->ring->tails[slot]);
+            if (head - tail <= usable)
+                used = max(used, head - tail);
+        }
+    }
+    spin_unlock(&adxl_dev->files_lock);
+
+    return used;
+}
+
+// Number of samples the ring can take without overwriting one that a reader still needs (TP5)
+// Only used with the drop-newest policy
+static u32 adxl345_ring_room(struct adxl345_device *adxl_dev)
+{
+    u32 usable = adxl_dev->ring_size - ADXL345_RING_GUARD;
+
+    return usable - min(adxl345_ring_used(adxl_dev), usable);
+}
+
+// Make the n samples stored since the last call visible to the readers (TP5)
+static void adxl345_ring_publish(struct adxl345_device *adxl_dev, u32 n)
+{
+    u32 head = adxl_dev->ring_head + n;
+
+    // Publish the records before the new head, for the files and for the mapped header
+    smp_store_release(&adxl_dev->ring_head, head);
+    smp_store_release(&adxl_dev->ring->head, head);
+}
+
+static void adxl345_vm_open(struct vm_area_struct *vma)
+{
+    struct adxl345_device *adxl_dev = vma->vm_private_data;
+
+    kref_get(&adxl_dev->kref);
+    atomic_inc(&adxl_dev->ring_mappers);
+}
+
+static void adxl345_vm_close(struct vm_area_struct *vma)
+{
+    struct adxl345_device *adxl_dev = vma->vm_private_data;
+
+    atomic_dec(&adxl_dev->ring_mappers);
+    kref_put(&adxl_dev->kref, adxl345_free);
+}
 
-    struct mutex lock; // Declare the mutex lock
+static const struct vm_operations_struct adxl345_vm_ops = {
+    .open = adxl345_vm_open,
+    .close = adxl345_vm_close,
 };
 
+// Map the sample ring into the application (TP5)
+static int adxl345_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct adxl345_file *pf = file->private_data;
+    struct adxl345_device *adxl_dev = pf->adxl_dev;
+    int ret;
+
+    // The ring can't be swapped under our feet
+    mutex_lock(&adxl_dev->lock);
+
+    if (adxl_dev->dead) {
+        ret = -ENODEV;
+        goto out;
+    }
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > adxl_dev->ring_bytes) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = remap_vmalloc_range(vma, adxl_dev->ring, 0);
+    if (ret)
+        goto out;
 
-// Custom IOCTL commands (TP3 - part3)
-#define ADXL_IOCTL_SET_AXIS_X _IO('X', 0)
-#define ADXL_IOCTL_SET_AXIS_Y _IO('Y', 1)
-#define ADXL_IOCTL_SET_AXIS_Z _IO('Z', 2)
+    vma->vm_ops = &adxl345_vm_ops;
+    vma->vm_private_data = adxl_dev;
+    // The open callback is not called for the initial mapping
+    adxl345_vm_open(vma);
 
-static int current_axis = ADXL_IOCTL_SET_AXIS_X;  // Default axis is X
+out:
+    mutex_unlock(&adxl_dev->lock);
+    return ret;
+}
+
+// Give the file its own tail in the mapped header, so that several mappings can hold the
+// drop-newest producer back each at its own position (TP5)
+static int adxl345_ring_slot(struct adxl345_device *adxl_dev, struct adxl345_file *pf)
+{
+    int slot;
+
+    lockdep_assert_held(&adxl_dev->lock);
 
+    if (pf->slot >= 0)
+        return pf->slot;
+
+    slot = find_first_zero_bit(adxl_dev->ring_slots, ADXL345_RING_SLOTS);
+    if (slot >= ADXL345_RING_SLOTS)
+        return -EBUSY;
+    set_bit(slot, adxl_dev->ring_slots);
+
+    // Start the consumer at the current head so it only sees fresh samples
+    WRITE_ONCE(adxl_dev->ring->tails[slot], smp_load_acquire(&adxl_dev->ring_head));
+    smp_store_release(&pf->slot, slot);
+    return slot;
+}
+
+
+// Current configuration, as reported to user space (TP5)
+static void adxl345_get_config(struct adxl345_device *adxl_dev, struct adxl345_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->odr_mhz = adxl345_odr_mhz[adxl_dev->bw_rate & 0xF];
+    cfg->range_g = 2 << (adxl_dev->data_format & ADXL345_DATA_FORMAT_RANGE_MASK);
+    cfg->full_res = !!(adxl_dev->data_format & ADXL345_DATA_FORMAT_FULL_RES);
+    cfg->watermark = adxl_dev->watermark;
+}
+
+// Adaptive watermark: the largest one delivering samples within the latency budget (TP5)
+// The first entry of a batch waits watermark periods for the interrupt, then the drain time.
+// Readers only get woken up every lowat samples anyway, and when nobody reads at all the latency
+// doesn't matter, so the budget grows to match and the FIFO is batched as much as possible.
+// Called with the IRQ thread not running: from the thread itself or with the IRQ disabled.
+static void adxl345_tune_watermark(struct adxl345_device *adxl_dev)
+{
+    u64 period = adxl345_period_ns(adxl_dev->bw_rate);
+    u64 budget = (u64)READ_ONCE(adxl_dev->latency_us) * NSEC_PER_USEC;
+    u64 drain = adxl_dev->drain_ns;
+    u32 max_wm;
+    u32 wm;
+
+    if (!budget)
+        return;
+
+    // Entries keep arriving during the drain, leave them room in the 32-entry FIFO
+    max_wm = ADXL345_FIFO_DEPTH - 1 - min_t(u64, div64_u64(drain, period) + 1, ADXL345_FIFO_DEPTH - 2);
+
+    if (list_empty(&adxl_dev->files) && !atomic_read(&adxl_dev->ring_mappers))
+        wm = max_wm;
+    else {
+        budget = max(budget, READ_ONCE(adxl_dev->lowat) * period);
+        wm = budget > drain ? min_t(u64, div64_u64(budget - drain, period), max_wm) : 1;
+        wm = max(wm, 1U);
+    }
+
+    // The regmap cache skips the write when the watermark doesn't move
+    if (wm != adxl_dev->watermark &&
+        !adxl345_write_reg(adxl_dev, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_STREAM_MODE | wm))
+        adxl_dev->watermark = wm;
+}
+
+// Program a new output data rate, range, resolution and watermark (TP5)
+// The IRQ is disabled meanwhile so that a drain never mixes two configurations, and the ring is resized
+// to keep about ADXL345_RING_SECONDS of samples when nobody else is using it.
+static int adxl345_set_config(struct adxl345_device *adxl_dev, const struct adxl345_config *cfg, struct adxl345_file *caller)
+{
+    u8 bw_rate = adxl345_rate_code(cfg->odr_mhz);
+    u8 data_format;
+    int ret;
+
+    lockdep_assert_held(&adxl_dev->lock);
+
+    if (cfg->range_g != 2 && cfg->range_g != 4 && cfg->range_g != 8 && cfg->range_g != 16)
+        return -EINVAL;
+    if (cfg->full_res > 1 || cfg->watermark == 0 || cfg->watermark >= ADXL345_FIFO_DEPTH)
+        return -EINVAL;
+
+    data_format = (adxl_dev->data_format & ~(ADXL345_DATA_FORMAT_FULL_RES | ADXL345_DATA_FORMAT_RANGE_MASK)) |
+                  (ilog2(cfg->range_g) - 1) | (cfg->full_res ? ADXL345_DATA_FORMAT_FULL_RES : 0);
+
+    disable_irq(adxl_dev->irq);
+    // After the IRQ thread gave up, empty the FIFO: the watermark line goes low, and the stream
+    // mode below raises it again once the FIFO refills
+    ret = adxl_dev->irq_off ? adxl345_write_reg(adxl_dev, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_BYPASS_MODE) : 0;
+    if (!ret)
+        ret = adxl345_write_reg(adxl_dev, ADXL345_REG_BW_RATE, bw_rate);
+    if (!ret)
+        ret = adxl345_write_reg(adxl_dev, ADXL345_REG_DATA_FORMAT, data_format);
+    if (!ret)
+        ret = adxl345_write_reg(adxl_dev, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_STREAM_MODE | cfg->watermark);
+    // The cache holds whatever reached the device, follow it
+    if (!ret) {
+        adxl_dev->bw_rate = bw_rate;
+        adxl_dev->data_format = data_format;
+        // Entries of the old rate may be left in the FIFO
+        adxl_dev->next_timestamp = 0;
+        adxl_dev->watermark = cfg->watermark;
+        // The adaptive watermark, if on, follows the new rate
+        adxl345_tune_watermark(adxl_dev);
+    }
+    enable_irq(adxl_dev->irq);
+    // The line is still disabled once by the IRQ thread then, nothing can run it meanwhile
+    if (!ret && adxl_dev->irq_off) {
+        adxl_dev->irq_off = false;
+        enable_irq(adxl_dev->irq);
+    }
+    if (ret)
+        return ret;
+
+    // Readers keep the current ring, only with less or more slack than planned
+    ret = adxl345_ring_resize(adxl_dev, adxl345_ring_size_for(adxl_dev, bw_rate), caller);
+    return ret == -EBUSY ? 0 : ret;
+}
+
+// Turn the adaptive watermark on (latency_us > 0) or off, applied at once rather than at the next
+// interrupt, which can be minutes away at low rates (TP5)
+static void adxl345_set_latency(struct adxl345_device *adxl_dev, u32 latency_us)
+{
+    lockdep_assert_held(&adxl_dev->lock);
+
+    disable_irq(adxl_dev->irq);
+    WRITE_ONCE(adxl_dev->latency_us, latency_us);
+    adxl345_tune_watermark(adxl_dev);
+    enable_irq(adxl_dev->irq);
+}
+
+// Next to the FIFO drain it relies on
+static int adxl345_self_calibrate(struct adxl345_device *adxl_dev, u32 samples, s8 *offset);
+
+// Custom IOCTL commands are defined in adxl345.h (TP3 - part3)
+// The axis, format and lowat settings only apply to this file, the configuration to the whole device
 static long adxl345_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+    struct adxl345_file *pf = file->private_data;
+    struct adxl345_device *adxl_dev = pf->adxl_dev;
+    struct adxl345_config cfg;
+    struct adxl345_format fmt;
+    struct adxl345_calibration calib;
+    __u32 lowat;
+    __u32 latency_us;
+    __u64 overruns;
+    int ret;
+
     switch (cmd) {
         case ADXL_IOCTL_SET_AXIS_X:
+            WRITE_ONCE(pf->format, ADXL345_FORMAT(ADXL345_AXIS_X, ADXL345_LAYOUT_S16));
+            return 0;
         case ADXL_IOCTL_SET_AXIS_Y:
+            WRITE_ONCE(pf->format, ADXL345_FORMAT(ADXL345_AXIS_Y, ADXL345_LAYOUT_S16));
+            return 0;
         case ADXL_IOCTL_SET_AXIS_Z:
-            current_axis = cmd;
+            WRITE_ONCE(pf->format, ADXL345_FORMAT(ADXL345_AXIS_Z, ADXL345_LAYOUT_S16));
+            return 0;
+        case ADXL_IOCTL_SET_AXIS_ALL:
+            WRITE_ONCE(pf->format, ADXL345_FORMAT(ADXL345_AXIS_ALL, ADXL345_LAYOUT_RECORD));
             return 0;
+        case ADXL_IOCTL_SET_FORMAT:
+            if (copy_from_user(&fmt, (void __user *)arg, sizeof(fmt)))
+                return -EFAULT;
+            if (fmt.axes == 0 || fmt.axes & ~ADXL345_AXIS_ALL || fmt.layout > ADXL345_LAYOUT_RECORD || fmt.reserved)
+                return -EINVAL;
+            WRITE_ONCE(pf->format, ADXL345_FORMAT(fmt.axes, fmt.layout));
+            return 0;
+        case ADXL_IOCTL_SET_LOWAT:
+            if (get_user(lowat, (__u32 __user *)arg))
+                return -EFAULT;
+            ret = mutex_lock_interruptible(&adxl_dev->lock);
+            if (ret)
+                return ret;
+            if (lowat == 0 || lowat > adxl_dev->ring_size - ADXL345_RING_GUARD) {
+                mutex_unlock(&adxl_dev->lock);
+                return -EINVAL;
+            }
+            WRITE_ONCE(pf->lowat, lowat);
+            adxl345_update_lowat(adxl_dev);
+            mutex_unlock(&adxl_dev->lock);
+            return 0;
+        case ADXL_IOCTL_GET_OVERRUNS:
+            ret = mutex_lock_interruptible(&pf->read_lock);
+            if (ret)
+                return ret;
+            overruns = pf->overruns;
+            mutex_unlock(&pf->read_lock);
+            return put_user(overruns, (__u64 __user *)arg);
+        case ADXL_IOCTL_GET_CONFIG:
+            ret = mutex_lock_interruptible(&adxl_dev->lock);
+            if (ret)
+                return ret;
+            adxl345_get_config(adxl_dev, &cfg);
+            mutex_unlock(&adxl_dev->lock);
+            if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg)))
+                return -EFAULT;
+            return 0;
+        case ADXL_IOCTL_SET_CONFIG:
+            if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+                return -EFAULT;
+            // Our own reads are held off, in case the ring gets resized
+            ret = mutex_lock_interruptible(&pf->read_lock);
+            if (ret)
+                return ret;
+            ret = mutex_lock_interruptible(&adxl_dev->lock);
+            if (ret) {
+                mutex_unlock(&pf->read_lock);
+                return ret;
+            }
+            // The accelerometer and its IRQ are gone once it is unbound
+            ret = adxl_dev->dead ? -ENODEV : adxl345_set_config(adxl_dev, &cfg, pf);
+            mutex_unlock(&adxl_dev->lock);
+            mutex_unlock(&pf->read_lock);
+            return ret;
+        case ADXL_IOCTL_CALIBRATE:
+            if (copy_from_user(&calib, (void __user *)arg, sizeof(calib)))
+                return -EFAULT;
+            ret = mutex_lock_interruptible(&adxl_dev->lock);
+            if (ret)
+                return ret;
+            if (adxl_dev->dead) {
+                mutex_unlock(&adxl_dev->lock);
+                return -ENODEV;
+            }
+            // The IRQ thread would take the samples
+            disable_irq(adxl_dev->irq);
+            ret = adxl345_self_calibrate(adxl_dev, calib.samples, calib.offset);
+            enable_irq(adxl_dev->irq);
+            mutex_unlock(&adxl_dev->lock);
+            if (ret)
+                return ret;
+            if (copy_to_user((void __user *)arg, &calib, sizeof(calib)))
+                return -EFAULT;
+            return 0;
+        case ADXL_IOCTL_SET_LATENCY:
+            if (get_user(latency_us, (__u32 __user *)arg))
+                return -EFAULT;
+            ret = mutex_lock_interruptible(&adxl_dev->lock);
+            if (ret)
+                return ret;
+            ret = adxl_dev->dead ? -ENODEV : 0;
+            if (!ret)
+                adxl345_set_latency(adxl_dev, latency_us);
+            mutex_unlock(&adxl_dev->lock);
+            return ret;
+        case ADXL_IOCTL_RING_SLOT:
+            ret = mutex_lock_interruptible(&adxl_dev->lock);
+            if (ret)
+                return ret;
+            ret = adxl_dev->dead ? -ENODEV : adxl345_ring_slot(adxl_dev, pf);
+            mutex_unlock(&adxl_dev->lock);
+            if (ret < 0)
+                return ret;
+            return put_user(ret, (__u32 __user *)arg);
         default:
             return -ENOTTY;  // Not a valid ioctl command
     }
 }
 
 
-// Function to read data from the accelerometer
-static ssize_t adxl345_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
-{   
-    struct adxl345_device *adxl_dev;
-    struct i2c_client *client;
-    ssize_t ret;
+// Scale of the samples in tenths of mg per LSB: 3.9 mg/LSB in full resolution, else for +/-2g
+// and doubling with each range (TP5)
+static int adxl345_mg_x10(u8 data_format)
+{
+    return 39 << (data_format & ADXL345_DATA_FORMAT_FULL_RES ? 0 : data_format & ADXL345_DATA_FORMAT_RANGE_MASK);
+}
+
+// Size in bytes of one sample in an output format (TP5)
+static size_t adxl345_sample_bytes(unsigned int axes, unsigned int layout)
+{
+    size_t n = hweight8(axes);
+
+    switch (layout) {
+        case ADXL345_LAYOUT_S16:
+            return n * sizeof(s16);
+        case ADXL345_LAYOUT_S16_PADDED:
+            return roundup_pow_of_two(n * sizeof(s16));
+        case ADXL345_LAYOUT_S32_MG:
+            return n * sizeof(s32);
+        default:
+            return sizeof(struct fifo_element);
+    }
+}
+
+// Keep the selected axes of n samples, in the layout of the file (TP5)
+// mg_x10 is the scale of the samples, in tenths of mg per LSB
+static void adxl345_format_samples(u8 *out, const struct fifo_element *samples, unsigned int n,
+                                   unsigned int axes, unsigned int layout, int mg_x10)
+{
+    size_t size = adxl345_sample_bytes(axes, layout);
+    unsigned int i, j, k;
+    s16 v[3];
+
+    for (i = 0; i < n; i++, out += size) {
+        v[0] = samples[i].x;
+        v[1] = samples[i].y;
+        v[2] = samples[i].z;
+        for (j = 0, k = 0; j < 3; j++) {
+            if (!(axes & BIT(j)))
+                continue;
+            if (layout == ADXL345_LAYOUT_S32_MG)
+                ((s32 *)out)[k++] = v[j] * mg_x10 / 10;
+            else
+                ((s16 *)out)[k++] = v[j];
+        }
+        if (layout == ADXL345_LAYOUT_S16_PADDED)
+            for (k *= sizeof(s16); k < size; k++)
+                out[k] = 0;
+    }
+}
 
+// Number of samples this file has not read yet (TP5)
+static u32 adxl345_pending(struct adxl345_file *pf)
+{
+    // Pairs with the release in adxl345_ring_publish: the records before ring_head are in place
+    return smp_load_acquire(&pf->adxl_dev->ring_head) - READ_ONCE(pf->cursor);
+}
 
-    // Retrieve the instance of the struct adxl345_device
-    adxl_dev = container_of(file->private_data, struct adxl345_device, miscdev);
+// Enough samples are queued to wake this reader up (TP5)
+static bool adxl345_readable(struct adxl345_file *pf)
+{
+    return adxl345_pending(pf) >= READ_ONCE(pf->lowat);
+}
 
-    mutex_lock(&adxl_dev->lock); // Acquire the mutex lock
+// The same for a file reading from the mapping, against the tail it publishes in its ring slot (TP5)
+static bool adxl345_ring_readable(struct adxl345_file *pf, int slot)
+{
+    struct adxl345_device *adxl_dev = pf->adxl_dev;
 
-    // Retrieve the instance of the struct i2c_client
-    client = to_i2c_client(adxl_dev->miscdev.parent);
+    return smp_load_acquire(&adxl_dev->ring_head) - READ_ONCE(adxl_dev->ring->tails[slot]) >= READ_ONCE(pf->lowat);
+}
 
-    // Define the address of register axis
-    char reg_data_address;
-    switch (current_axis) {
-        case ADXL_IOCTL_SET_AXIS_X:
-            reg_data_address = 'X';
+// Copy up to n samples from the ring at the cursor of this file into pf->samples (TP5)
+// Lock-free: the producer never waits for readers, so a reader that fell too far behind skips the
+// samples that were overwritten, and a copy the producer lapped in the meantime is done again
+static unsigned int adxl345_ring_get(struct adxl345_file *pf, unsigned int n)
+{
+    struct adxl345_device *adxl_dev = pf->adxl_dev;
+    u32 size = adxl_dev->ring_size;
+    u32 usable = size - ADXL345_RING_GUARD;
+    u32 pending;
+    unsigned int i;
+
+    for (;;) {
+        pending = adxl345_pending(pf);
+        if (pending > usable) {
+            pf->overruns += pending - usable;
+            atomic_long_add(pending - usable, &adxl_dev->sw_overruns);
+            WRITE_ONCE(pf->cursor, pf->cursor + pending - usable);
+            pending = usable;
+        }
+
+        n = min(n, pending);
+        for (i = 0; i < n; i++)
+            pf->samples[i] = adxl_dev->ring_data[(pf->cursor + i) & (size - 1)];
+
+        // The records are still valid if the producer didn't move into them while we were copying
+        smp_rmb();
+        if (READ_ONCE(adxl_dev->ring_head) - pf->cursor <= usable)
             break;
-        case ADXL_IOCTL_SET_AXIS_Y:
-            reg_data_address = 'Y';
+    }
+
+    // The producer may reuse the records only once they are copied out (drop-newest policy)
+    smp_store_release(&pf->cursor, pf->cursor + n);
+    return n;
+}
+
+// Function to read data from the accelerometer
+// Returns as many samples as fit in buf and this file has not read yet, in the format of the file:
+// whole struct fifo_element records with ADXL_IOCTL_SET_AXIS_ALL, one s16 per sample with
+// ADXL_IOCTL_SET_AXIS_X/Y/Z, any ADXL_IOCTL_SET_FORMAT otherwise (TP5)
+static ssize_t adxl345_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{   
+    struct adxl345_file *pf = file->private_data;
+    struct adxl345_device *adxl_dev = pf->adxl_dev;
+    u16 format = READ_ONCE(pf->format);
+    unsigned int axes = format & 0xFF;
+    unsigned int layout = format >> 8;
+    size_t size = adxl345_sample_bytes(axes, layout);
+    int mg_x10;
+    size_t copied = 0;
+    unsigned int n;
+    ssize_t ret = 0;
+
+    // Only whole records are returned
+    if (layout == ADXL345_LAYOUT_RECORD && count < size)
+        return -EINVAL;
+
+    if (count == 0)
+        return 0;
+
+    // From now on this file holds the producer back with the drop-newest policy
+    if (!READ_ONCE(pf->reading))
+        WRITE_ONCE(pf->reading, true);
+
+    // Check if data is available in the ring, if not, put the process in to wait until lowat samples are queued
+    // Non-blocking readers get whatever is there
+    // The wait is done without read_lock, which the ioctls of this file take too: another thread
+    // reading the same file may get the samples first, so they are checked again under the lock
+    for (;;) {
+        if (file->f_flags & O_NONBLOCK) {
+            if (adxl345_pending(pf) == 0)
+                return READ_ONCE(adxl_dev->dead) ? -ENODEV : -EAGAIN;
+        } else {
+            if (adxl345_pending(pf) == 0)
+                adxl345_dbg(adxl_dev, 1, "FIFO is empty, waiting for %u samples\n", READ_ONCE(pf->lowat));
+            ret = wait_event_interruptible(adxl_dev->wait_queue, adxl345_readable(pf) || READ_ONCE(adxl_dev->dead));
+            if (ret)
+                return ret;
+        }
+
+        ret = mutex_lock_interruptible(&pf->read_lock);
+        if (ret)
+            return ret;
+        // No more samples will come once the accelerometer is unbound
+        if (READ_ONCE(adxl_dev->dead)) {
+            ret = -ENODEV;
+            goto out;
+        }
+        if (adxl345_pending(pf))
             break;
-        case ADXL_IOCTL_SET_AXIS_Z:
-            reg_data_address = 'Z';
+        mutex_unlock(&pf->read_lock);
+    }
+
+    // Samples calibrated in the drain are already in mg
+    mg_x10 = READ_ONCE(adxl_dev->calib.mg) ? 10 : adxl345_mg_x10(READ_ONCE(adxl_dev->data_format));
+
+    while (count - copied >= size) {
+        n = adxl345_ring_get(pf, min_t(size_t, ARRAY_SIZE(pf->samples), (count - copied) / size));
+        if (n == 0)
             break;
-        default:
-            return -EINVAL;  // Invalid argument
+
+        trace_adxl345_dequeue(adxl_dev->miscdev.this_device, n, pf->cursor, pf->samples[0].timestamp);
+
+        if (layout == ADXL345_LAYOUT_RECORD) {
+            if (copy_to_user(buf + copied, pf->samples, n * size))
+                ret = -EFAULT;
+        } else {
+            adxl345_format_samples(pf->out, pf->samples, n, axes, layout, mg_x10);
+            if (copy_to_user(buf + copied, pf->out, n * size))
+                ret = -EFAULT;
+        }
+        if (ret)
+            break; // Error while copying data to user space
+        copied += n * size;
+        atomic_long_add(n, &adxl_dev->delivered);
     }
 
+    // Pass part of one sample to the application, as before
+    if (!copied && !ret && count < size && adxl345_ring_get(pf, 1)) {
+        adxl345_format_samples(pf->out, pf->samples, 1, axes, layout, mg_x10);
+        if (copy_to_user(buf, pf->out, count))
+            ret = -EFAULT;
+        else
+            copied = count;
+        atomic_long_inc(&adxl_dev->delivered);
+    }
 
+out:
+    mutex_unlock(&pf->read_lock);
 
-    // Check if data is available in the FIFO, if not, put the process in to wait
-    if(kfifo_is_empty(&adxl_dev->samples_fifo))
-        printk("FIFO is empty!!\n");
-    wait_event_interruptible(adxl_dev->wait_queue, !kfifo_is_empty(&adxl_dev->samples_fifo));
+    // Samples already consumed are lost on a fault, report what did reach the application
+    if (copied)
+        return copied;
+    return ret;
+}
 
-    // Data available in the FIFO, retrieve it
-    struct fifo_element sample;
-    ret = kfifo_get(&adxl_dev->samples_fifo, &sample);
+// Let poll/select/epoll wait for lowat samples (TP5)
+static __poll_t adxl345_poll(struct file *file, poll_table *wait)
+{
+    struct adxl345_file *pf = file->private_data;
+    int slot;
 
-    s16 accel_data;
+    poll_wait(file, &pf->adxl_dev->wait_queue, wait);
 
-    if(reg_data_address == 'X')
-        accel_data = sample.x;
-    else if (reg_data_address == 'Y')
-        accel_data = sample.y;
-    else if (reg_data_address == 'Z')
-        accel_data = sample.z;
-    else {
-        pr_err("Wrong axis!!!!!\n");
-        return -EIO;
+    if (READ_ONCE(pf->adxl_dev->dead))
+        return EPOLLIN | EPOLLRDNORM | EPOLLHUP | EPOLLERR;
+    // Mapping consumers got a slot, so that they can poll too instead of looking at the ring in a loop
+    slot = smp_load_acquire(&pf->slot);
+    if (slot >= 0 ? adxl345_ring_readable(pf, slot) : adxl345_readable(pf))
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+// Pop num_samples entries (up to ADXL345_FIFO_DEPTH) from the accelerometer FIFO into adxl_dev->reg_data, 6 bytes per entry (TP5)
+// Each entry is a write(DATAX0)/read(6) pair joined by a repeated start, and all the pairs of a
+// batch go out in a single i2c_transfer, so the adapter is locked once per batch instead of per entry
+static int adxl345_drain_fifo(struct adxl345_device *adxl_dev, struct i2c_client *client, int num_samples)
+{
+    const struct i2c_adapter_quirks *quirks = client->adapter->quirks;
+    struct i2c_msg *msgs = adxl_dev->msgs;
+    int max_batch = num_samples;
+    int done = 0;
+    int batch;
+    int ret = 0;
+    int i;
+
+    // Some adapters cap the number of messages per transfer
+    if (quirks && quirks->max_num_msgs)
+        max_batch = max(quirks->max_num_msgs / 2, 1);
+
+    adxl_dev->data_reg = ADXL345_DATAX0;
+    while (done < num_samples) {
+        batch = min(max_batch, num_samples - done);
+        for (i = 0; i < batch; i++) {
+            msgs[2 * i].addr = client->addr;
+            msgs[2 * i].flags = (client->flags & I2C_M_TEN) | I2C_M_DMA_SAFE;
+            msgs[2 * i].len = 1;
+            msgs[2 * i].buf = &adxl_dev->data_reg;
+
+            msgs[2 * i + 1].addr = client->addr;
+            msgs[2 * i + 1].flags = (client->flags & I2C_M_TEN) | I2C_M_RD | I2C_M_DMA_SAFE;
+            msgs[2 * i + 1].len = 6;
+            msgs[2 * i + 1].buf = &adxl_dev->reg_data[(done + i) * 6];
+        }
+
+        ret = i2c_transfer(client->adapter, msgs, 2 * batch);
+        if (ret < 0)
+            break;
+        // Only complete write/read pairs hold a valid entry
+        done += ret / 2;
+        if (ret != 2 * batch) {
+            ret = -EIO;
+            break;
         }
+    }
 
+    // Report the entries we did get, they are already gone from the accelerometer FIFO
+    if (done == 0 && ret < 0)
+        return ret;
+    return done;
+}
 
-    // Pass all or part of this sample to the application
-    if (count >= sizeof(accel_data)) {
-        count = sizeof(accel_data);
+// Self-calibration: average samples samples at rest, flat with Z up, and program OFSX/OFSY/OFSZ so
+// that they read 0, 0 and +1 g (TP5)
+// The samples are drained straight from the accelerometer FIFO, so the IRQ thread must not run: called
+// before the IRQ is requested, or with it disabled. The readers don't get them.
+static int adxl345_self_calibrate(struct adxl345_device *adxl_dev, u32 samples, s8 *offset)
+{
+    struct i2c_client *client = to_i2c_client(adxl_dev->miscdev.parent);
+    u64 period = adxl345_period_ns(adxl_dev->bw_rate);
+    int mg_x10 = adxl345_mg_x10(adxl_dev->data_format);
+    unsigned int fifo_status;
+    unsigned long timeout;
+    s64 sum[3] = { 0 };
+    s32 mean;
+    u32 got = 0;
+    bool flushed = false;
+    int n;
+    int ret;
+    int i, j;
+
+    lockdep_assert_held(&adxl_dev->lock);
+
+    if (samples == 0 || samples > ADXL345_CALIB_MAX_SAMPLES)
+        return -EINVAL;
+    // The entries drained here never reach the ring
+    adxl_dev->next_timestamp = 0;
+    // Every other user of the device waits for us: at low rates, ask for a faster one first
+    if ((samples + ADXL345_FIFO_DEPTH) * period > ADXL345_CALIB_MAX_MS * NSEC_PER_MSEC)
+        return -EINVAL;
+
+    for (i = 0; i < 3; i++) {
+        ret = adxl345_write_reg(adxl_dev, ADXL345_REG_OFSX + i, 0);
+        if (ret)
+            return ret;
     }
 
-    if (copy_to_user(buf, &accel_data, count)) {
-        // Error while copying data to user space
-        return -EFAULT;
+    // Twice the time the samples should take, plus the entries flushed below
+    timeout = jiffies + nsecs_to_jiffies((samples + ADXL345_FIFO_DEPTH) * period * 2) + HZ / 10;
+
+    // What the FIFO holds was acquired with the old offsets
+    for (;;) {
+        if (time_after(jiffies, timeout))
+            return -ETIMEDOUT;
+
+        ret = regmap_read(adxl_dev->regmap, ADXL345_REG_FIFO_STATUS, &fifo_status);
+        if (ret)
+            return ret;
+        n = min_t(int, fifo_status & ADXL345_FIFO_ENTRIES_MASK, ADXL345_FIFO_DEPTH);
+        if (n) {
+            ret = adxl345_drain_fifo(adxl_dev, client, n);
+            if (ret < 0)
+                return ret;
+            if (!flushed) {
+                flushed = true;
+                continue;
+            }
+            for (i = 0; i < ret && got < samples; i++, got++)
+                for (j = 0; j < 3; j++)
+                    sum[j] += (s16)(adxl_dev->reg_data[i * 6 + 2 * j + 1] << 8 | adxl_dev->reg_data[i * 6 + 2 * j]);
+            if (got == samples)
+                break;
+        }
+
+        // Let the FIFO fill up with what is still missing, half of it at most
+        msleep_interruptible(DIV_ROUND_UP_ULL(min_t(u64, samples - got, ADXL345_FIFO_DEPTH / 2) * period, NSEC_PER_MSEC));
+        if (signal_pending(current))
+            return -EINTR;
     }
 
-    mutex_unlock(&adxl_dev->lock); // Release the mutex lock
-    
-    return count;
+    for (j = 0; j < 3; j++) {
+        // Mean in tenths of mg, Z should see +1 g
+        mean = div_s64(sum[j] * mg_x10, samples) - (j == 2 ? 10000 : 0);
+        offset[j] = clamp_t(s32, -DIV_ROUND_CLOSEST(mean, ADXL345_OFS_MG_X10), S8_MIN, S8_MAX);
+        ret = adxl345_write_reg(adxl_dev, ADXL345_REG_OFSX + j, (u8)offset[j]);
+        if (ret)
+            return ret;
+    }
 
+    return 0;
+}
+
+// Apply the software calibration to a sample, in the drain so that readers get it for free (TP5)
+static void adxl345_calibrate(struct adxl345_device *adxl_dev, struct fifo_element *sample)
+{
+    s16 raw[3] = { sample->x, sample->y, sample->z };
+    int mg_x10 = adxl345_mg_x10(adxl_dev->data_format);
+    s16 *out[3] = { &sample->x, &sample->y, &sample->z };
+    s64 acc;
+    int r, c;
+
+    for (r = 0; r < 3; r++) {
+        acc = 0;
+        for (c = 0; c < 3; c++)
+            acc += (s64)adxl_dev->calib.gain[r][c] * raw[c];
+        acc = div_s64(acc, ADXL345_CALIB_ONE) + adxl_dev->calib.offset[r];
+        if (adxl_dev->calib.mg)
+            acc = div_s64(acc * mg_x10, 10);
+        *out[r] = clamp_t(s64, acc, S16_MIN, S16_MAX);
+    }
+}
+
+// Account for one I2C burst of duration ns (TP5)
+static void adxl345_drain_stats(struct adxl345_device *adxl_dev, u64 duration)
+{
+    if (!adxl_dev->drains || duration < adxl_dev->drain_min_ns)
+        adxl_dev->drain_min_ns = duration;
+    adxl_dev->drain_max_ns = max(adxl_dev->drain_max_ns, duration);
+    adxl_dev->drain_total_ns += duration;
+    adxl_dev->drains++;
+}
+
+// Top half: only note when the watermark was reached, the samples are timestamped from it (TP5)
+static irqreturn_t adxl345_irq(int irq, void *dev_id)
+{
+    struct adxl345_device *adxl_dev = dev_id;
+
+    adxl_dev->irq_timestamp = ktime_get_boottime_ns();
+    trace_adxl345_irq(adxl_dev->miscdev.this_device, adxl_dev->irq_timestamp);
+    return IRQ_WAKE_THREAD;
 }
 
 // Write the bottom half function ( adxl345_int for example):
 static irqreturn_t adxl345_int(int irq, void *dev_id)
 {
-    pr_info("This is interupt handle\n");
     struct adxl345_device *adxl_dev = dev_id;
     // Convert the pointer to `adxl_dev->miscdev.parent` into a pointer to `client` (Make adxl_dev->miscdev.parent have type struct i2c_client)
     struct i2c_client *client = to_i2c_client(adxl_dev->miscdev.parent);
 
-    u8 fifo_status_reg = ADXL345_REG_FIFO_STATUS;
-    u8 fifo_status;
+    unsigned int int_source;
+    unsigned int fifo_status;
+    int num_samples;
     int ret;
+    int i;
+    u32 stored;
+    u64 start;
+    u64 duration;
+    u64 drain;
+    bool failed;
+    int attempts = 0;
+    u64 period = adxl345_period_ns(adxl_dev->bw_rate);
+    // The top half may run again while we drain, keep the time of the interrupt that woke us up
+    u64 irq_time = READ_ONCE(adxl_dev->irq_timestamp);
+    // The interrupt fired when the watermark-th entry of the FIFO was acquired, so the timestamp of the
+    // first entry of this batch is back-interpolated from there, the following ones are one period apart
+    u64 timestamp = irq_time - (adxl_dev->watermark - 1) * period;
+    u64 next = adxl_dev->next_timestamp;
+
+    adxl_dev->irqs++;
+
+    // The entries follow on from the last batch, whose timestamps are already out: carry on from
+    // there rather than from an interrupt time that came late, e.g. an edge held back until the
+    // thread was done with the last batch. A gap of more than a batch means entries were lost, and
+    // a continuation later than the interrupt is the sample clock drifting, the interrupt wins then.
+    if (next && next <= timestamp && timestamp - next <= adxl_dev->watermark * period)
+        timestamp = next;
+
+    // The watermark line stays asserted as long as the FIFO holds at least watermark entries,
+    // and new samples keep arriving while we read, so drain in a loop instead of a single pass.
+    // Only a FIFO_STATUS below the watermark ends it, the line was low then: with an edge-triggered
+    // interrupt, the next time the FIFO reaches the watermark raises it again.
+retry:
+    failed = false;
+    do {
+        // The overrun bit is cleared by reading the data registers, so sample it before draining
+        ret = regmap_read(adxl_dev->regmap, ADXL345_REG_INT_SOURCE, &int_source);
+        if (ret) {
+            adxl_dev->i2c_errors++;
+            dev_err_ratelimited(&client->dev, "Failed to read INT_SOURCE\n");
+            failed = true;
+            break;
+        }
+        if (int_source & ADXL345_INT_OVERRUN)
+            adxl_dev->hw_overruns++;
+
+        // Read FIFO status register to determine the number of samples available
+        ret = regmap_read(adxl_dev->regmap, ADXL345_REG_FIFO_STATUS, &fifo_status);
+        if (ret) {
+            adxl_dev->i2c_errors++;
+            dev_err_ratelimited(&client->dev, "Failed to read FIFO status\n");
+            failed = true;
+            break;
+        }
 
-    // Read FIFO status register to determine the number of samples available
-    ret = i2c_master_send(client, &fifo_status_reg, 1);
-    if (ret != 1) {
-        pr_err("Failed to send command to read FIFO status\n");
-        return ret; // or appropriate error handling
-    }
-    ret = i2c_master_recv(client, &fifo_status, 1);
-    if (ret != 1) {
-        pr_err("Failed to read FIFO status\n");
-        return ret; // or appropriate error handling
-    }
+        // Check FIFO status to determine the number of samples available
+        num_samples = min_t(int, fifo_status & ADXL345_FIFO_ENTRIES_MASK, ADXL345_FIFO_DEPTH); // Bits 0-5 represent the number of samples (up to 32)
+        trace_adxl345_fifo_status(adxl_dev->miscdev.this_device, int_source, num_samples);
+        adxl_dev->entries_hist[num_samples]++;
+        adxl345_dbg(adxl_dev, 1, "Number of samples available in FIFO: %d\n", num_samples);
+        if (num_samples == 0)
+            break;
+        // Entries were lost: the FIFO is full and its newest entry was just acquired
+        if (int_source & ADXL345_INT_OVERRUN)
+            timestamp = max(timestamp, ktime_get_boottime_ns() - (num_samples - 1) * period);
+
+        // Retrieve all samples from the accelerometer FIFO, in order, into the buffer of the device
+        u8 *reg_data = adxl_dev->reg_data;
+        int num_byte_read; // Each sample contains 2 bytes of data from 3 axis
+        // Timed for the debugfs statistics whether traced or not, the trace reports the same duration
+        start = ktime_get_ns();
+        ret = adxl345_drain_fifo(adxl_dev, client, num_samples);
+        duration = ktime_get_ns() - start;
+        adxl345_drain_stats(adxl_dev, duration);
+        trace_adxl345_drain(adxl_dev->miscdev.this_device, ret > 0 ? ret * 6 : 0, duration, ret < 0 ? ret : 0);
+        if (ret != num_samples)
+            adxl_dev->i2c_errors++;
+        if (ret > 0)
+            adxl_dev->hw_samples += ret;
+        if (ret != num_samples)
+            dev_err_ratelimited(&client->dev, "Failed to read FIFO entries (%d/%d)\n", ret, num_samples);
+        num_byte_read = ret > 0 ? ret * 6 : 0;
+
+        // With the drop-newest policy, only what fits in front of the slowest reader is stored
+        stored = num_byte_read / 6;
+        if (READ_ONCE(adxl_dev->drop_newest))
+            stored = min(stored, adxl345_ring_room(adxl_dev));
+        if (stored != num_byte_read / 6) {
+            atomic_long_add(num_byte_read / 6 - stored, &adxl_dev->sw_overruns);
+            WRITE_ONCE(adxl_dev->ring->dropped, adxl_dev->ring->dropped + num_byte_read / 6 - stored);
+        }
 
-    // Check FIFO status to determine the number of samples available
-    int num_samples = fifo_status & 0x1F; // Bits 0-4 represent the number of samples
-    pr_info("Number of samples available in FIFO: %d\n", num_samples);
+        for (i = 0; i < num_byte_read; i += 6) { // Travel through each sample by increasing the index by 6 (bytes) each time
+            struct fifo_element sample;
+            // Get X-axis data from reg_data
+            sample.x = (s16)(reg_data[i + 1] << 8) | reg_data[i];
+            // Get Y-axis data from reg_data
+            sample.y = (s16)(reg_data[i + 3] << 8) | reg_data[i + 2];
+            // Get Z-axis data from reg_data
+            sample.z = (s16)(reg_data[i + 5] << 8) | reg_data[i + 4];
+            sample.reserved = 0;
+            if (adxl_dev->calib.active)
+                adxl345_calibrate(adxl_dev, &sample);
+            sample.timestamp = timestamp;
+            timestamp += period;
+
+            adxl345_dbg(adxl_dev, 2, "FIFO's data of %d sample is: %d %d %d\n", i / 6, sample.x, sample.y, sample.z);
+
+            if (i / 6 < stored)
+                adxl345_ring_put(adxl_dev, &sample, i / 6);
+        }
 
-    // Read samples from the accelerometer FIFO
-    u8 reg_data_address[] = {ADXL345_DATAX0, ADXL345_DATAX1, ADXL345_DATAY0, ADXL345_DATAY1, ADXL345_DATAZ0, ADXL345_DATAZ1};
-    i2c_master_send(client, reg_data_address, 6);
+        // Wake up processes waiting for data, once enough of it is there
+        adxl345_ring_publish(adxl_dev, stored);
+        if (trace_adxl345_enqueue_enabled())
+            trace_adxl345_enqueue(adxl_dev->miscdev.this_device, stored, num_byte_read / 6 - stored,
+                                  adxl_dev->ring_head, adxl345_ring_used(adxl_dev));
+        if (adxl_dev->ring_head - adxl_dev->wake_head >= READ_ONCE(adxl_dev->lowat)) {
+            adxl_dev->wake_head = adxl_dev->ring_head;
+            trace_adxl345_wakeup(adxl_dev->miscdev.this_device, adxl_dev->ring_head, READ_ONCE(adxl_dev->lowat));
+            wake_up_interruptible(&adxl_dev->wait_queue);
+        }
 
-    // Allocate memory for reg_data dynamically
-    int num_byte_read = num_samples * 3 * 2 * sizeof(u8); // Each sample contains 2 bytes of data from 3 axis
-    u8 *reg_data = kmalloc(num_byte_read, GFP_KERNEL);
-    if (!reg_data) {
-        pr_err("Failed to allocate memory for reg_data\n");
-        return IRQ_HANDLED; // or appropriate error handling
+        // A short read means the bus failed, don't spin on it
+        if (num_byte_read != num_samples * 6) {
+            failed = true;
+            break;
+        }
+    } while (num_samples >= adxl_dev->watermark);
+
+    // A bus error leaves the FIFO at or above the watermark: an edge-triggered line would never be
+    // raised again, a level-triggered one would fire again at once. Retry a few times, then give up
+    // until SET_CONFIG reprograms the FIFO.
+    if (failed) {
+        if (++attempts < ADXL345_MAX_FAILURES) {
+            usleep_range(1000, 2000);
+            goto retry;
+        }
+        disable_irq_nosync(irq);
+        adxl_dev->irq_off = true;
+        dev_err(&client->dev, "FIFO drain keeps failing, interrupt disabled until the next SET_CONFIG\n");
     }
 
-    // Retrieve all samples from the accelerometer FIFO
-    i2c_master_recv(client, reg_data, num_byte_read);
+    adxl_dev->next_timestamp = timestamp;
+
+    // Running average over the last 8 or so interrupts, it includes the thread wake up latency
+    drain = ktime_get_boottime_ns() - irq_time;
+    adxl_dev->drain_ns = adxl_dev->drain_ns ? adxl_dev->drain_ns - adxl_dev->drain_ns / 8 + drain / 8 : drain;
+    // A lower watermark applies from the next interrupt on, which may fire at once if the FIFO already holds
+    // that much: those few samples get timestamped up to a drain time late
+    adxl345_tune_watermark(adxl_dev);
+
+    return IRQ_HANDLED;
+}
+
+
+// Statistics of the device, for spotting saturation without enabling any logging (TP5)
+static int adxl345_stats_show(struct seq_file *s, void *unused)
+{
+    struct adxl345_device *adxl_dev = s->private;
+    unsigned long drains;
     int i;
-    for (i = 0; i < num_byte_read; i += 6) { // Travel through each sample by increasing the index by 6 (bytes) each time
-        struct fifo_element sample;
-        // Get X-axis data from reg_data
-        sample.x = (s16)(reg_data[i + 1] << 8) | reg_data[i];
-        // Get Y-axis data from reg_data
-        sample.y = (s16)(reg_data[i + 3] << 8) | reg_data[i + 2];
-        // Get Z-axis data from reg_data
-        sample.z = (s16)(reg_data[i + 5] << 8) | reg_data[i + 4];
 
-        printk("FIFO's data of %d sample is: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n", i/6, reg_data[i], reg_data[i + 1], reg_data[i + 2], reg_data[i + 3],
-        reg_data[i + 4], reg_data[i + 5]);
+    // The ring can't be swapped meanwhile
+    mutex_lock(&adxl_dev->lock);
+
+    seq_printf(s, "irqs: %lu\n", READ_ONCE(adxl_dev->irqs));
+    seq_printf(s, "hw_samples: %lu\n", READ_ONCE(adxl_dev->hw_samples));
+    seq_printf(s, "delivered: %ld\n", atomic_long_read(&adxl_dev->delivered));
+    seq_printf(s, "dropped: %ld\n", atomic_long_read(&adxl_dev->sw_overruns));
+    seq_printf(s, "hw_overruns: %lu\n", READ_ONCE(adxl_dev->hw_overruns));
+    seq_printf(s, "i2c_errors: %lu\n", READ_ONCE(adxl_dev->i2c_errors));
 
-        ret = kfifo_put(&adxl_dev->samples_fifo, sample);
+    drains = READ_ONCE(adxl_dev->drains);
+    seq_printf(s, "drains: %lu\n", drains);
+    seq_printf(s, "drain_ns: min %llu avg %llu max %llu\n", drains ? adxl_dev->drain_min_ns : 0,
+               drains ? div64_u64(adxl_dev->drain_total_ns, drains) : 0, adxl_dev->drain_max_ns);
+
+    seq_printf(s, "ring_size: %u\n", adxl_dev->ring_size);
+    seq_printf(s, "ring_depth: %u\n", adxl345_ring_used(adxl_dev));
+    seq_printf(s, "watermark: %u\n", adxl_dev->watermark);
+    seq_printf(s, "irq_off: %d\n", READ_ONCE(adxl_dev->irq_off));
+
+    mutex_unlock(&adxl_dev->lock);
+
+    // How full the accelerometer FIFO was at each drain, 32 meaning it may have overflowed
+    seq_puts(s, "fifo_entries:");
+    for (i = 0; i <= ADXL345_FIFO_DEPTH; i++)
+        seq_printf(s, " %lu", READ_ONCE(adxl_dev->entries_hist[i]));
+    seq_puts(s, "\n");
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(adxl345_stats);
+
+// Overrun counters, exported in /sys/class/misc/adxl345-N/ so that loss can be checked under load
+static ssize_t overruns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct miscdevice *miscdev = dev_get_drvdata(dev);
+    struct adxl345_device *adxl_dev = container_of(miscdev, struct adxl345_device, miscdev);
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(adxl_dev->hw_overruns));
+}
+static DEVICE_ATTR_RO(overruns);
+
+static ssize_t dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct miscdevice *miscdev = dev_get_drvdata(dev);
+    struct adxl345_device *adxl_dev = container_of(miscdev, struct adxl345_device, miscdev);
+
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&adxl_dev->sw_overruns));
+}
+static DEVICE_ATTR_RO(dropped);
+
+// Runtime configuration, the same as ADXL_IOCTL_SET_CONFIG one field at a time (TP5)
+static struct adxl345_device *adxl345_from_dev(struct device *dev)
+{
+    struct miscdevice *miscdev = dev_get_drvdata(dev);
+
+    return container_of(miscdev, struct adxl345_device, miscdev);
+}
+
+static ssize_t adxl345_config_show(struct device *dev, char *buf, size_t offset)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    struct adxl345_config cfg;
+
+    mutex_lock(&adxl_dev->lock);
+    adxl345_get_config(adxl_dev, &cfg);
+    mutex_unlock(&adxl_dev->lock);
+
+    if (offset == offsetof(struct adxl345_config, odr_mhz))
+        return sysfs_emit(buf, "%u\n", cfg.odr_mhz);
+    return sysfs_emit(buf, "%u\n", *((u8 *)&cfg + offset));
+}
+
+static ssize_t adxl345_config_store(struct device *dev, const char *buf, size_t count, size_t offset)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    struct adxl345_config cfg;
+    u32 val;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&adxl_dev->lock);
+    adxl345_get_config(adxl_dev, &cfg);
+    if (offset == offsetof(struct adxl345_config, odr_mhz))
+        cfg.odr_mhz = val;
+    else if (val > U8_MAX)
+        ret = -EINVAL;
+    else
+        *((u8 *)&cfg + offset) = val;
+    if (!ret)
+        ret = adxl345_set_config(adxl_dev, &cfg, NULL);
+    mutex_unlock(&adxl_dev->lock);
+
+    return ret ? ret : count;
+}
+
+#define ADXL345_CONFIG_ATTR(field)                                                                      \
+static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf)               \
+{                                                                                                       \
+    return adxl345_config_show(dev, buf, offsetof(struct adxl345_config, field));                      \
+}                                                                                                       \
+static ssize_t field##_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) \
+{                                                                                                       \
+    return adxl345_config_store(dev, buf, count, offsetof(struct adxl345_config, field));              \
+}                                                                                                       \
+static DEVICE_ATTR_RW(field)
+
+ADXL345_CONFIG_ATTR(odr_mhz);
+ADXL345_CONFIG_ATTR(range_g);
+ADXL345_CONFIG_ATTR(full_res);
+ADXL345_CONFIG_ATTR(watermark);
+
+// Calibration, written back at boot by whoever keeps it (udev rule, init script) (TP5)
+// Call with the lock held, the IRQ is disabled so that no drain sees half of it
+static void adxl345_calib_update(struct adxl345_device *adxl_dev, const s32 *gain, const s32 *offset, int mg)
+{
+    int r, c;
+    bool active = false;
+
+    lockdep_assert_held(&adxl_dev->lock);
+
+    disable_irq(adxl_dev->irq);
+    if (gain)
+        memcpy(adxl_dev->calib.gain, gain, sizeof(adxl_dev->calib.gain));
+    if (offset)
+        memcpy(adxl_dev->calib.offset, offset, sizeof(adxl_dev->calib.offset));
+    if (mg >= 0)
+        adxl_dev->calib.mg = mg;
+
+    for (r = 0; r < 3; r++) {
+        active |= adxl_dev->calib.offset[r] != 0;
+        for (c = 0; c < 3; c++)
+            active |= adxl_dev->calib.gain[r][c] != (r == c ? ADXL345_CALIB_ONE : 0);
     }
+    adxl_dev->calib.active = active || adxl_dev->calib.mg;
+    enable_irq(adxl_dev->irq);
+}
 
-    // Free the dynamic array
-    kfree(reg_data);
+// Offsets the accelerometer adds itself, "x y z" in 15.6 mg/LSB, -128 to 127
+static ssize_t calib_offset_hw_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    unsigned int ofs[3] = { 0 };
+    int i;
 
-    // Wake up processes waiting for data
-    wake_up_interruptible(&adxl_dev->wait_queue);
+    // From the regmap cache
+    for (i = 0; i < 3; i++)
+        regmap_read(adxl_dev->regmap, ADXL345_REG_OFSX + i, &ofs[i]);
+    return sysfs_emit(buf, "%d %d %d\n", (s8)ofs[0], (s8)ofs[1], (s8)ofs[2]);
+}
 
-    // Delay for 10 seconds (10000 milliseconds)
-    msleep(10000);
+static ssize_t calib_offset_hw_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    int ofs[3];
+    int ret = 0;
+    int i;
 
-    return IRQ_HANDLED;
+    if (sscanf(buf, "%d %d %d", &ofs[0], &ofs[1], &ofs[2]) != 3)
+        return -EINVAL;
+    for (i = 0; i < 3; i++)
+        if (ofs[i] < S8_MIN || ofs[i] > S8_MAX)
+            return -EINVAL;
+
+    mutex_lock(&adxl_dev->lock);
+    for (i = 0; i < 3 && !ret; i++)
+        ret = adxl345_write_reg(adxl_dev, ADXL345_REG_OFSX + i, (u8)ofs[i]);
+    mutex_unlock(&adxl_dev->lock);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(calib_offset_hw);
+
+// Software gain matrix, 9 values row by row, 65536 meaning 1.0
+static ssize_t calib_gain_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    s32 g[3][3];
+
+    mutex_lock(&adxl_dev->lock);
+    memcpy(g, adxl_dev->calib.gain, sizeof(g));
+    mutex_unlock(&adxl_dev->lock);
+
+    return sysfs_emit(buf, "%d %d %d %d %d %d %d %d %d\n", g[0][0], g[0][1], g[0][2], g[1][0], g[1][1], g[1][2],
+                      g[2][0], g[2][1], g[2][2]);
+}
+
+static ssize_t calib_gain_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    s32 g[9];
+
+    if (sscanf(buf, "%d %d %d %d %d %d %d %d %d", &g[0], &g[1], &g[2], &g[3], &g[4], &g[5], &g[6], &g[7], &g[8]) != 9)
+        return -EINVAL;
+
+    mutex_lock(&adxl_dev->lock);
+    adxl345_calib_update(adxl_dev, g, NULL, -1);
+    mutex_unlock(&adxl_dev->lock);
+
+    return count;
 }
+static DEVICE_ATTR_RW(calib_gain);
+
+// Software offset added after the gain, "x y z" in LSB
+static ssize_t calib_offset_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    s32 o[3];
+
+    mutex_lock(&adxl_dev->lock);
+    memcpy(o, adxl_dev->calib.offset, sizeof(o));
+    mutex_unlock(&adxl_dev->lock);
+
+    return sysfs_emit(buf, "%d %d %d\n", o[0], o[1], o[2]);
+}
+
+static ssize_t calib_offset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    s32 o[3];
+
+    if (sscanf(buf, "%d %d %d", &o[0], &o[1], &o[2]) != 3)
+        return -EINVAL;
 
+    mutex_lock(&adxl_dev->lock);
+    adxl345_calib_update(adxl_dev, NULL, o, -1);
+    mutex_unlock(&adxl_dev->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(calib_offset);
+
+// 1: the samples are converted to mg in the drain, for every reader and the mapped ring
+static ssize_t calib_mg_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%d\n", READ_ONCE(adxl345_from_dev(dev)->calib.mg));
+}
+
+static ssize_t calib_mg_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    bool mg;
+    int ret;
+
+    ret = kstrtobool(buf, &mg);
+    if (ret)
+        return ret;
+
+    mutex_lock(&adxl_dev->lock);
+    adxl345_calib_update(adxl_dev, NULL, NULL, mg);
+    mutex_unlock(&adxl_dev->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(calib_mg);
+
+// Size of the sample ring in records, 0 to follow the output data rate (TP5)
+// It can only change while no file is open and the ring isn't mapped
+static ssize_t ring_size_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    ssize_t ret;
+
+    mutex_lock(&adxl_dev->lock);
+    ret = sysfs_emit(buf, "%u\n", adxl_dev->ring_size);
+    mutex_unlock(&adxl_dev->lock);
+    return ret;
+}
+
+static ssize_t ring_size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    u32 old;
+    u32 val;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &val);
+    if (ret)
+        return ret;
+    if (!adxl345_ring_size_valid(val))
+        return -EINVAL;
+
+    mutex_lock(&adxl_dev->lock);
+    old = adxl_dev->ring_request;
+    adxl_dev->ring_request = val;
+    ret = adxl345_ring_resize(adxl_dev, adxl345_ring_size_for(adxl_dev, adxl_dev->bw_rate), NULL);
+    if (ret)
+        adxl_dev->ring_request = old;
+    mutex_unlock(&adxl_dev->lock);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(ring_size);
+
+// What happens when a reader falls behind: "oldest" overwrites its oldest samples, "newest" drops the new ones (TP5)
+static ssize_t drop_policy_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%s\n", READ_ONCE(adxl345_from_dev(dev)->drop_newest) ? "newest" : "oldest");
+}
+
+static ssize_t drop_policy_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+
+    if (sysfs_streq(buf, "oldest"))
+        WRITE_ONCE(adxl_dev->drop_newest, false);
+    else if (sysfs_streq(buf, "newest"))
+        WRITE_ONCE(adxl_dev->drop_newest, true);
+    else
+        return -EINVAL;
+
+    return count;
+}
+static DEVICE_ATTR_RW(drop_policy);
+
+// Latency budget of the adaptive watermark in us, the same as ADXL_IOCTL_SET_LATENCY (TP5)
+static ssize_t latency_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(adxl345_from_dev(dev)->latency_us));
+}
+
+static ssize_t latency_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct adxl345_device *adxl_dev = adxl345_from_dev(dev);
+    u32 val;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&adxl_dev->lock);
+    adxl345_set_latency(adxl_dev, val);
+    mutex_unlock(&adxl_dev->lock);
+
+    return count;
+}
+static DEVICE_ATTR_RW(latency_us);
+
+static struct attribute *adxl345_attrs[] = {
+    &dev_attr_overruns.attr,
+    &dev_attr_dropped.attr,
+    &dev_attr_odr_mhz.attr,
+    &dev_attr_range_g.attr,
+    &dev_attr_full_res.attr,
+    &dev_attr_watermark.attr,
+    &dev_attr_latency_us.attr,
+    &dev_attr_ring_size.attr,
+    &dev_attr_drop_policy.attr,
+    &dev_attr_calib_offset_hw.attr,
+    &dev_attr_calib_gain.attr,
+    &dev_attr_calib_offset.attr,
+    &dev_attr_calib_mg.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(adxl345);
 
 
 
@@ -233,37 +1721,35 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
 {
     /////////////////////////// TP2 ///////////////////////////
     // Declaration of variables
-    u8 reg_data[2];
-    int ret_arr[5];
+    struct regmap *regmap;
+    int ret_arr[8];
     int i;
     ///////////////////////////////////////////////////////
-    // Configure I2C messages
+    // All the register accesses go through a regmap, whose cache keeps the configuration (TP5)
+    regmap = devm_regmap_init_i2c(client, &adxl345_regmap_config);
+    if (IS_ERR(regmap)) {
+        printk("Failed to initialize the regmap\n");
+        return PTR_ERR(regmap);
+    }
+
+    // Configure the registers, these writes always reach the device and fill the cache
     // Define output data rate
-    reg_data[0] = ADXL345_REG_BW_RATE;
-    reg_data[1] = ADXL345_OUTPUT_RATE_100HZ;
-    ret_arr[0] = i2c_master_send(client, reg_data, 2);
+    ret_arr[0] = regmap_write(regmap, ADXL345_REG_BW_RATE, ADXL345_OUTPUT_RATE_100HZ);
     // All interrupts disabled
-    reg_data[0] = ADXL345_REG_INT_ENABLE;
-    reg_data[1] = ADXL345_ALL_INTERRUPTS_DISABLED;
-    ret_arr[1] = i2c_master_send(client, reg_data, 2);
-
+    ret_arr[1] = regmap_write(regmap, ADXL345_REG_INT_ENABLE, ADXL345_ALL_INTERRUPTS_DISABLED);
     // Default data format
-    reg_data[0] = ADXL345_REG_DATA_FORMAT;
-    reg_data[1] = ADXL345_DATA_FORMAT_DEFAULT;
-    ret_arr[2] = i2c_master_send(client, reg_data, 2);
-
+    ret_arr[2] = regmap_write(regmap, ADXL345_REG_DATA_FORMAT, ADXL345_DATA_FORMAT_DEFAULT);
     // FIFO bypass
-    reg_data[0] = ADXL345_REG_FIFO_CTL;
-    reg_data[1] = ADXL345_FIFO_BYPASS_MODE;
-    ret_arr[3] = i2c_master_send(client, reg_data, 2);
-
+    ret_arr[3] = regmap_write(regmap, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_BYPASS_MODE);
     // Measurement mode activated
-    reg_data[0] = ADXL345_REG_POWER_CTL;
-    reg_data[1] = ADXL345_MEASURE_MODE;
-    ret_arr[4] = i2c_master_send(client, reg_data, 2);
-
-    for (i = 0; i < 5; i++){
-        if(ret_arr[i] != 2){
+    ret_arr[4] = regmap_write(regmap, ADXL345_REG_POWER_CTL, ADXL345_MEASURE_MODE);
+    // No hardware offsets, the calibration is restored through sysfs (TP5)
+    ret_arr[5] = regmap_write(regmap, ADXL345_REG_OFSX, 0);
+    ret_arr[6] = regmap_write(regmap, ADXL345_REG_OFSY, 0);
+    ret_arr[7] = regmap_write(regmap, ADXL345_REG_OFSZ, 0);
+
+    for (i = 0; i < 8; i++){
+        if(ret_arr[i]){
             printk("Failed to probe ADXL345\n");
             return ret_arr[i];
         }
@@ -279,6 +1765,34 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
     if (!adxl345_dev)
         return -ENOMEM; //Out of Memory error
 
+    adxl345_dev->regmap = regmap;
+    kref_init(&adxl345_dev->kref); // Dropped in adxl345_remove
+
+    // Initialize the queue before anything (reader or interrupt) can use it
+    init_waitqueue_head(&adxl345_dev->wait_queue);
+    adxl345_dev->irq = client->irq;
+    adxl345_dev->bw_rate = ADXL345_OUTPUT_RATE_100HZ;
+    adxl345_dev->data_format = ADXL345_DATA_FORMAT_DEFAULT;
+    adxl345_dev->watermark = ADXL345_FIFO_WATERMARK;
+    adxl345_dev->lowat = 1;
+    mutex_init(&adxl345_dev->lock); // Initialize the mutex lock
+    INIT_LIST_HEAD(&adxl345_dev->files);
+    spin_lock_init(&adxl345_dev->files_lock);
+    if (adxl345_ring_size_valid(ring_size))
+        adxl345_dev->ring_request = ring_size;
+    else
+        pr_warn("Invalid ring_size %u, following the output data rate\n", ring_size);
+    adxl345_dev->drop_newest = drop_newest;
+    for (i = 0; i < 3; i++)
+        adxl345_dev->calib.gain[i][i] = ADXL345_CALIB_ONE;
+
+    // Allocate the ring shared with user space (TP5)
+    ret = adxl345_ring_alloc(adxl345_dev);
+    if (ret) {
+        kfree(adxl345_dev);
+        return ret;
+    }
+
     // Associate this instance with the struct i2c_client
     adxl345_dev->miscdev.parent = &client->dev;
 
@@ -286,6 +1800,7 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
     // Generate unique name
     name = kasprintf(GFP_KERNEL, "adxl345-%d", num_accelerometers++);
     if (!name) {
+        vfree(adxl345_dev->ring);
         kfree(adxl345_dev);
         return -ENOMEM; //Out of Memory error
     }
@@ -293,97 +1808,135 @@ static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *
     // Declare the read function in the file operations structure
     static const struct file_operations adxl345_fops = {
         .owner = THIS_MODULE,
+        .open = adxl345_open,
+        .release = adxl345_release,
         .read = adxl345_read,
+        .unlocked_ioctl = adxl345_ioctl,
+        .mmap = adxl345_mmap,
+        .poll = adxl345_poll,
     };
     // Fill the content of the miscdevice structure
     adxl345_dev->miscdev.minor = MISC_DYNAMIC_MINOR; // dynamically assign a minor number
     adxl345_dev->miscdev.name = name;
     adxl345_dev->miscdev.fops = &adxl345_fops; // No fops at the moment
+    adxl345_dev->miscdev.groups = adxl345_groups; // Counters and runtime configuration
 
     // Register with the misc framework
     ret = misc_register(&adxl345_dev->miscdev);
     if (ret) {
         pr_info("Failed to register %s\n", adxl345_dev->miscdev.name);
+        kfree(name);
+        vfree(adxl345_dev->ring);
         kfree(adxl345_dev);
         return ret;
     }
 
-    // Free the name as it's no longer needed
-    kfree(name);
+    // The name stays in use by the misc device, it is freed in adxl345_remove
+
+    // Statistics in /sys/kernel/debug/adxl345-N/ (TP5)
+    adxl345_dev->debugfs = debugfs_create_dir(name, NULL);
+    debugfs_create_file("stats", 0444, adxl345_dev->debugfs, adxl345_dev, &adxl345_stats_fops);
 
     // Associate the instance with the i2c_client
     i2c_set_clientdata(client, adxl345_dev);
 
     pr_info("Successfully registered %s\n", adxl345_dev->miscdev.name);
     /////////////////////////// TP4 ///////////////////////////
-    // Configure the accelerometer correctly (registers INT_ENABLE and FIFO_CTL)
-    // Enable Watermark interrupt in INT_ENABLE register
-    reg_data[0] = ADXL345_REG_INT_ENABLE;
-    reg_data[1] = 0x02; //1 << 2; // Watermark interrupt bit (00000010)
-    ret = i2c_master_send(client, reg_data, 2);
-    if (ret != 2) {
-        pr_err("Failed to enable Watermark interrupt\n");
-        return ret;
-    }
+    // The runtime configuration (ioctl, sysfs) waits until the IRQ is set up
+    mutex_lock(&adxl345_dev->lock);
 
+    // Configure the accelerometer correctly (registers INT_ENABLE and FIFO_CTL)
     // Configure FIFO_CTL register to enable FIFO mode and set watermark level to 20
-    reg_data[0] = ADXL345_REG_FIFO_CTL;
-    reg_data[1] = 0x94; //(1 << 7) | 20; // FIFO Stream mode enabled, watermark level set to 20 (10000000 OR 00010100)
-    ret = i2c_master_send(client, reg_data, 2);
-    if (ret != 2) {
+    ret = adxl345_write_reg(adxl345_dev, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_STREAM_MODE | adxl345_dev->watermark); // FIFO Stream mode enabled, watermark level set to 20 (10000000 OR 00010100)
+    if (ret) {
         pr_err("Failed to configure FIFO_CTL register\n");
-        return ret;
+        goto unlock;
+    }
+
+    // Self-calibration, now that the FIFO fills up and before the IRQ thread drains it (TP5)
+    if (calibrate) {
+        s8 offset[3];
+
+        ret = adxl345_self_calibrate(adxl345_dev, calibrate, offset);
+        if (ret)
+            pr_warn("%s: self-calibration failed (%d)\n", adxl345_dev->miscdev.name, ret);
+        else
+            pr_info("%s: self-calibration offsets %d %d %d\n", adxl345_dev->miscdev.name, offset[0], offset[1], offset[2]);
+        ret = 0;
     }
 
     // Register a function as a bottom half to handle interrupts with the Threaded IRQ mechanism
-    ret = devm_request_threaded_irq(&client->dev, client->irq, NULL, adxl345_int, IRQF_TRIGGER_HIGH | IRQF_ONESHOT, "adxl345_int", adxl345_dev);
+    // The trigger type comes from the firmware (device tree, or whoever created the I2C device):
+    // adxl345_int leaves the FIFO below the watermark, so a level or a rising edge both work (TP5)
+    ret = devm_request_threaded_irq(&client->dev, client->irq, adxl345_irq, adxl345_int, IRQF_ONESHOT, "adxl345_int", adxl345_dev);
     if (ret) {
         pr_err("Failed to register IRQ handler\n");
-        return ret;
+        goto unlock;
     }
 
-    // Initialize FIFO
-    INIT_KFIFO(adxl345_dev->samples_fifo);
+    // Enable Watermark interrupt in INT_ENABLE register, only now that the handler is there to drain the FIFO
+    ret = adxl345_write_reg(adxl345_dev, ADXL345_REG_INT_ENABLE, ADXL345_INT_WATERMARK); // Watermark interrupt bit (00000010)
+    if (ret) {
+        pr_err("Failed to enable Watermark interrupt\n");
+        devm_free_irq(&client->dev, client->irq, adxl345_dev);
+        goto unlock;
+    }
+
+unlock:
+    if (ret)
+        adxl345_dev->dead = true;
+    mutex_unlock(&adxl345_dev->lock);
+    if (ret) {
+        // Undo TP3, files opened meanwhile keep the instance until they are closed
+        wake_up_interruptible_all(&adxl345_dev->wait_queue);
+        misc_deregister(&adxl345_dev->miscdev);
+        debugfs_remove_recursive(adxl345_dev->debugfs);
+        num_accelerometers--;
+        kref_put(&adxl345_dev->kref, adxl345_free);
+        return ret;
+    }
 
-    // Initialize the queue
-    init_waitqueue_head(&adxl345_dev->wait_queue);
-    
     pr_info("Successfully probe TP4\n");
 
-    mutex_init(&adxl345_dev->lock); // Initialize the mutex lock
-    
-    
     return 0;
 }
 
 
 static int adxl345_remove(struct i2c_client *client)
 {
+    // Retrieve the instance of the struct adxl345_device from the struct i2c_client retrieved as argument
+    struct adxl345_device *adxl345_dev = i2c_get_clientdata(client);
     // TP2
-    u8 reg_data[2];
     int ret;
     // Switch to standby mode in POWER_CTL register
-    reg_data[0] = ADXL345_REG_POWER_CTL;
-    reg_data[1] = ADXL345_STANDBY_MODE;
-
-    ret = i2c_master_send(client, reg_data, 2);
-    if (ret != 2){
-        printk("Failed to switch to standby mode !!\n");
-        return ret;
-    }
+    // The device gets unbound whatever is returned, so a failure must not skip the teardown below
+    ret = adxl345_write_reg(adxl345_dev, ADXL345_REG_POWER_CTL, ADXL345_STANDBY_MODE);
+    if (ret)
+        dev_err(&client->dev, "Failed to switch to standby mode: %d\n", ret);
 
     // TP3
-    // Retrieve the instance of the struct adxl345_device from the struct i2c_client retrieved as argument
-    struct adxl345_device *adxl345_dev = i2c_get_clientdata(client);
+    // Readers get -ENODEV from now on, the ioctls touching the accelerometer too
+    mutex_lock(&adxl345_dev->lock);
+    adxl345_dev->dead = true;
+    mutex_unlock(&adxl345_dev->lock);
+    wake_up_interruptible_all(&adxl345_dev->wait_queue);
+
     // Unregister from the misc framework
     misc_deregister(&adxl345_dev->miscdev);
 
+    // The IRQ is device-managed and would only be released after this function returns,
+    // free it now so that the handler cannot run on the freed instance
+    devm_free_irq(&client->dev, client->irq, adxl345_dev);
+
     // Decrement the number of accelerometers
     num_accelerometers--;
 
     pr_info("%s misc device unregistered successfully\n", adxl345_dev->miscdev.name);
 
-    kfree(adxl345_dev);
+    debugfs_remove_recursive(adxl345_dev->debugfs);
+
+    // Freed with the last open file or mapping, if any is left
+    kref_put(&adxl345_dev->kref, adxl345_free);
     //
     pr_info("Successfully remove!\n\n");
     return 0;
@@ -0,0 +1,515 @@
+// Software emulation of ADXL345 accelerometers, for testing the drivers without the hardware (TP5)
+// Each emulated accelerometer sits at address 0x53 on an I2C adapter of its own, in the manner of
+// i2c-stub, with its watermark/overrun line on a simulated interrupt (irq_sim). A hrtimer acquires
+// samples at the output data rate set in BW_RATE into a 32-entry FIFO, from a synthetic waveform.
+// Loading this module creates the adxl345 I2C devices, the adxl345_TP5 or adxl345_iio driver binds
+// to them as to real ones:
+//   insmod adxl345_emu.ko devices=4 waveform=sine amplitude_mg=500 frequency_hz=5
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/i2c.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irq_sim.h>
+#include <linux/irqdomain.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/fixp-arith.h>
+
+// irq_sim has no prompt of its own, it comes with an option selecting it
+#if !IS_ENABLED(CONFIG_IRQ_SIM)
+#error "adxl345_emu needs CONFIG_IRQ_SIM, enable e.g. CONFIG_GPIO_MOCKUP which selects it"
+#endif
+
+
+
+// Reference from https://www.analog.com/media/en/technical-documentation/data-sheets/adxl345.pdf (TP2)
+#define ADXL345_REG_DEVID       0x00
+#define ADXL345_REG_OFSX        0x1E
+#define ADXL345_REG_OFSZ        0x20
+#define ADXL345_REG_BW_RATE     0x2C
+#define ADXL345_REG_POWER_CTL   0x2D
+#define ADXL345_REG_INT_ENABLE  0x2E
+#define ADXL345_REG_INT_SOURCE  0x30
+#define ADXL345_REG_DATA_FORMAT 0x31
+#define ADXL345_DATAX0          0x32
+#define ADXL345_DATAZ1          0x37
+#define ADXL345_REG_FIFO_CTL    0x38
+#define ADXL345_REG_FIFO_STATUS 0x39
+#define ADXL345_NUM_REGS        0x40
+
+#define ADXL345_DEVID             0xE5
+#define ADXL345_OUTPUT_RATE_100HZ 0x0A
+#define ADXL345_MEASURE_MODE      0x08
+#define ADXL345_FIFO_MODE_MASK    0xC0 // 0: bypass, 0x40: FIFO, 0x80: stream, 0xC0: trigger
+#define ADXL345_FIFO_MODE_FIFO    0x40
+#define ADXL345_FIFO_SAMPLES_MASK 0x1F
+#define ADXL345_FIFO_DEPTH        32
+#define ADXL345_INT_DATA_READY    0x80
+#define ADXL345_INT_WATERMARK     0x02
+#define ADXL345_INT_OVERRUN       0x01
+#define ADXL345_DATA_FORMAT_FULL_RES   0x08
+#define ADXL345_DATA_FORMAT_RANGE_MASK 0x03
+
+#define ADXL345_EMU_ADDR    0x53
+#define ADXL345_EMU_MAX     16
+#define ADXL345_OFS_MG_X10  156 // Scale of the offset registers, in tenths of mg per LSB
+
+
+
+static unsigned int devices = 1;
+module_param(devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of emulated accelerometers, 1 to 16 (default 1)");
+
+static char *waveform = "static";
+module_param(waveform, charp, 0444);
+MODULE_PARM_DESC(waveform, "static (1 g on Z), sine (X and Y turning around Z) or noise (random on top of 1 g on Z)");
+
+static unsigned int amplitude_mg = 1000;
+module_param(amplitude_mg, uint, 0444);
+MODULE_PARM_DESC(amplitude_mg, "Amplitude of the sine and noise waveforms, in mg (default 1000)");
+
+static unsigned int frequency_hz = 1;
+module_param(frequency_hz, uint, 0444);
+MODULE_PARM_DESC(frequency_hz, "Frequency of the sine waveform, in Hz (default 1)");
+
+enum adxl345_emu_waveform {
+    ADXL345_EMU_STATIC,
+    ADXL345_EMU_SINE,
+    ADXL345_EMU_NOISE,
+};
+
+struct adxl345_emu {
+    struct i2c_adapter adap;
+    struct i2c_client *client;
+    int irq;                        // Simulated interrupt line of the INT1 pin
+
+    spinlock_t lock;                // Protects everything below, taken by the bus and the timer
+    u8 regs[ADXL345_NUM_REGS];
+    u8 pointer;                     // Register address of the next access
+    s16 fifo[ADXL345_FIFO_DEPTH][3];
+    unsigned int fifo_head;         // Oldest entry
+    unsigned int fifo_count;
+    s16 latest[3];                  // Data registers in bypass mode
+    bool overrun;
+    bool line;                      // Level of the INT1 pin when last looked at
+
+    struct hrtimer timer;           // Acquisition, at the output data rate
+    u64 samples;                    // Acquired since the start, the time base of the waveform
+    bool restart;                   // POWER_CTL or BW_RATE changed, the timer is restarted after the transfer
+};
+
+static struct irq_domain *adxl345_emu_domain;
+static struct fwnode_handle *adxl345_emu_fwnode;
+static struct adxl345_emu *adxl345_emus[ADXL345_EMU_MAX];
+static enum adxl345_emu_waveform adxl345_emu_waveform;
+
+
+// Sample period in ns for a BW_RATE rate code: 3200 Hz for 0xF, halved by each step below
+static u64 adxl345_emu_period_ns(u8 bw_rate)
+{
+    return 312500ULL << (0xF - (bw_rate & 0xF));
+}
+
+// Value of one axis in mg at sample number n
+static int adxl345_emu_wave(struct adxl345_emu *emu, int axis, u64 n)
+{
+    u64 t_ns = n * adxl345_emu_period_ns(emu->regs[ADXL345_REG_BW_RATE]);
+    int gravity = axis == 2 ? 1000 : 0;
+    u32 degrees;
+    u32 rem;
+
+    switch (adxl345_emu_waveform) {
+        case ADXL345_EMU_SINE:
+            // Phase in degrees of the rotation at frequency_hz, Y lagging X by a quarter turn
+            // Whole seconds are whole turns
+            div_u64_rem(t_ns, NSEC_PER_SEC, &rem);
+            degrees = div_u64((u64)rem * frequency_hz * 360, NSEC_PER_SEC) % 360;
+            if (axis == 0)
+                return (int)amplitude_mg * fixp_sin16(degrees) / 0x7FFF;
+            if (axis == 1)
+                return (int)amplitude_mg * fixp_cos16(degrees) / 0x7FFF;
+            return gravity;
+        case ADXL345_EMU_NOISE:
+            return gravity + (int)(get_random_u32() % (2 * amplitude_mg + 1)) - (int)amplitude_mg;
+        default:
+            return gravity;
+    }
+}
+
+// Acquire one sample the way the accelerometer does: offsets added, scaled and clipped to the data format
+static void adxl345_emu_acquire(struct adxl345_emu *emu, s16 *sample)
+{
+    u8 data_format = emu->regs[ADXL345_REG_DATA_FORMAT];
+    int range = data_format & ADXL345_DATA_FORMAT_RANGE_MASK;
+    // 3.9 mg/LSB in full resolution, else 10 bits over the range
+    int mg_x10 = 39 << (data_format & ADXL345_DATA_FORMAT_FULL_RES ? 0 : range);
+    int limit = data_format & ADXL345_DATA_FORMAT_FULL_RES ? 512 << range : 512;
+    int axis;
+    int val;
+
+    for (axis = 0; axis < 3; axis++) {
+        val = adxl345_emu_wave(emu, axis, emu->samples) * 10 +
+              (s8)emu->regs[ADXL345_REG_OFSX + axis] * ADXL345_OFS_MG_X10;
+        sample[axis] = clamp(val / mg_x10, -limit, limit - 1);
+    }
+    emu->samples++;
+}
+
+// Level of the INT_SOURCE bits, from the FIFO state
+static u8 adxl345_emu_int_source(struct adxl345_emu *emu)
+{
+    u8 watermark = emu->regs[ADXL345_REG_FIFO_CTL] & ADXL345_FIFO_SAMPLES_MASK;
+    u8 source = 0;
+
+    if (emu->regs[ADXL345_REG_FIFO_CTL] & ADXL345_FIFO_MODE_MASK) {
+        if (emu->fifo_count)
+            source |= ADXL345_INT_DATA_READY;
+        if (emu->fifo_count >= watermark)
+            source |= ADXL345_INT_WATERMARK;
+    } else {
+        source |= ADXL345_INT_DATA_READY;
+    }
+    if (emu->overrun)
+        source |= ADXL345_INT_OVERRUN;
+    return source;
+}
+
+// The INT1 pin, high while an enabled interrupt source is
+static bool adxl345_emu_int_line(struct adxl345_emu *emu)
+{
+    return adxl345_emu_int_source(emu) & emu->regs[ADXL345_REG_INT_ENABLE] &
+           (ADXL345_INT_WATERMARK | ADXL345_INT_OVERRUN);
+}
+
+// Store a new sample in the FIFO, the oldest one is lost when it is full in stream mode
+static void adxl345_emu_push(struct adxl345_emu *emu, const s16 *sample)
+{
+    u8 mode = emu->regs[ADXL345_REG_FIFO_CTL] & ADXL345_FIFO_MODE_MASK;
+    unsigned int tail;
+
+    memcpy(emu->latest, sample, sizeof(emu->latest));
+    if (!mode)
+        return;
+
+    if (emu->fifo_count == ADXL345_FIFO_DEPTH) {
+        emu->overrun = true;
+        // FIFO mode stops collecting once full
+        if (mode == ADXL345_FIFO_MODE_FIFO)
+            return;
+        emu->fifo_head = (emu->fifo_head + 1) % ADXL345_FIFO_DEPTH;
+        emu->fifo_count--;
+    }
+    tail = (emu->fifo_head + emu->fifo_count) % ADXL345_FIFO_DEPTH;
+    memcpy(emu->fifo[tail], sample, sizeof(emu->fifo[tail]));
+    emu->fifo_count++;
+}
+
+// Follow the INT1 pin after the FIFO or the interrupt registers changed, with the lock held
+// irq_sim only knows edges: the interrupt is raised on a low to high transition of the pin, as a
+// rising edge on the real one would, so a driver that drains below the watermark gets the next one.
+// Returns whether to raise it, which is done without the lock.
+static bool adxl345_emu_update_line(struct adxl345_emu *emu)
+{
+    bool level = adxl345_emu_int_line(emu);
+    bool rise = level && !emu->line;
+
+    emu->line = level;
+    return rise;
+}
+
+static void adxl345_emu_raise_irq(struct adxl345_emu *emu)
+{
+    irq_set_irqchip_state(emu->irq, IRQCHIP_STATE_PENDING, true);
+}
+
+static enum hrtimer_restart adxl345_emu_timer(struct hrtimer *timer)
+{
+    struct adxl345_emu *emu = container_of(timer, struct adxl345_emu, timer);
+    unsigned long flags;
+    u64 missed;
+    bool rise;
+    s16 sample[3];
+
+    spin_lock_irqsave(&emu->lock, flags);
+    // Standby was asked for while we were waiting for the lock
+    if (!(emu->regs[ADXL345_REG_POWER_CTL] & ADXL345_MEASURE_MODE)) {
+        spin_unlock_irqrestore(&emu->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+    // Catch up with the samples acquired while the timer was late, a FIFO worth at most
+    missed = hrtimer_forward_now(timer, ns_to_ktime(adxl345_emu_period_ns(emu->regs[ADXL345_REG_BW_RATE])));
+    missed = min_t(u64, max_t(u64, missed, 1), ADXL345_FIFO_DEPTH);
+    while (missed--) {
+        adxl345_emu_acquire(emu, sample);
+        adxl345_emu_push(emu, sample);
+    }
+    rise = adxl345_emu_update_line(emu);
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    if (rise)
+        adxl345_emu_raise_irq(emu);
+    return HRTIMER_RESTART;
+}
+
+// Start or stop the acquisition after a write to POWER_CTL or BW_RATE, without the lock
+// The timer is cancelled first, waiting for a callback that may be spinning on the lock, so that it
+// is never started again under a running callback. Transfers, the only callers, are serialized by
+// the adapter.
+static void adxl345_emu_restart(struct adxl345_emu *emu)
+{
+    unsigned long flags;
+    ktime_t period;
+    bool measure;
+
+    hrtimer_cancel(&emu->timer);
+
+    spin_lock_irqsave(&emu->lock, flags);
+    period = ns_to_ktime(adxl345_emu_period_ns(emu->regs[ADXL345_REG_BW_RATE]));
+    measure = emu->regs[ADXL345_REG_POWER_CTL] & ADXL345_MEASURE_MODE;
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    if (measure)
+        hrtimer_start(&emu->timer, period, HRTIMER_MODE_REL);
+}
+
+// Register write, with the lock held
+static void adxl345_emu_write(struct adxl345_emu *emu, u8 reg, u8 val)
+{
+    u8 old = emu->regs[reg];
+
+    switch (reg) {
+        case ADXL345_REG_DEVID:
+        case ADXL345_REG_INT_SOURCE:
+        case ADXL345_DATAX0 ... ADXL345_DATAZ1:
+        case ADXL345_REG_FIFO_STATUS:
+            return; // Read only
+    }
+    emu->regs[reg] = val;
+
+    if (reg == ADXL345_REG_FIFO_CTL && (val & ADXL345_FIFO_MODE_MASK) != (old & ADXL345_FIFO_MODE_MASK)) {
+        // Changing the FIFO mode clears it
+        emu->fifo_head = 0;
+        emu->fifo_count = 0;
+        emu->overrun = false;
+    }
+    if ((reg == ADXL345_REG_POWER_CTL && (val ^ old) & ADXL345_MEASURE_MODE) ||
+        (reg == ADXL345_REG_BW_RATE && (val ^ old) & 0xF))
+        emu->restart = true;
+}
+
+// Register read, with the lock held
+// Reading the data registers up to DATAZ1 pops the oldest FIFO entry, as one multi-byte read does
+static u8 adxl345_emu_read(struct adxl345_emu *emu, u8 reg)
+{
+    const s16 *sample;
+    u8 val;
+
+    switch (reg) {
+        case ADXL345_REG_INT_SOURCE:
+            return adxl345_emu_int_source(emu);
+        case ADXL345_REG_FIFO_STATUS:
+            return emu->fifo_count;
+        case ADXL345_DATAX0 ... ADXL345_DATAZ1:
+            sample = emu->fifo_count ? emu->fifo[emu->fifo_head] : emu->latest;
+            val = sample[(reg - ADXL345_DATAX0) / 2] >> ((reg & 1) ? 8 : 0);
+            if (reg == ADXL345_DATAZ1 && emu->fifo_count) {
+                emu->fifo_head = (emu->fifo_head + 1) % ADXL345_FIFO_DEPTH;
+                emu->fifo_count--;
+                emu->overrun = false;
+            }
+            return val;
+        default:
+            return emu->regs[reg];
+    }
+}
+
+// Plain I2C transfers: a write sets the register pointer then writes the following bytes, a read
+// goes on from the pointer, both auto-incrementing, as on the device
+static int adxl345_emu_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+    struct adxl345_emu *emu = i2c_get_adapdata(adap);
+    unsigned long flags;
+    bool restart;
+    bool rise;
+    int i, j;
+
+    for (i = 0; i < num; i++)
+        if (msgs[i].addr != ADXL345_EMU_ADDR || msgs[i].flags & I2C_M_TEN)
+            return -ENXIO;
+
+    spin_lock_irqsave(&emu->lock, flags);
+    for (i = 0; i < num; i++) {
+        if (msgs[i].flags & I2C_M_RD) {
+            for (j = 0; j < msgs[i].len; j++)
+                msgs[i].buf[j] = adxl345_emu_read(emu, emu->pointer++ % ADXL345_NUM_REGS);
+        } else if (msgs[i].len) {
+            emu->pointer = msgs[i].buf[0];
+            for (j = 1; j < msgs[i].len; j++)
+                adxl345_emu_write(emu, emu->pointer++ % ADXL345_NUM_REGS, msgs[i].buf[j]);
+        }
+        emu->pointer %= ADXL345_NUM_REGS;
+    }
+    restart = emu->restart;
+    emu->restart = false;
+    // Draining the FIFO may have dropped the pin, enabling an interrupt raised it
+    rise = adxl345_emu_update_line(emu);
+    spin_unlock_irqrestore(&emu->lock, flags);
+
+    if (rise)
+        adxl345_emu_raise_irq(emu);
+    if (restart)
+        adxl345_emu_restart(emu);
+
+    return num;
+}
+
+static u32 adxl345_emu_functionality(struct i2c_adapter *adap)
+{
+    return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm adxl345_emu_algorithm = {
+    .master_xfer = adxl345_emu_xfer,
+    .functionality = adxl345_emu_functionality,
+};
+
+// Create one emulated accelerometer, its adapter and its I2C device
+static struct adxl345_emu *adxl345_emu_create(unsigned int index)
+{
+    struct i2c_board_info info = { I2C_BOARD_INFO("adxl345", ADXL345_EMU_ADDR) };
+    struct adxl345_emu *emu;
+    int ret;
+
+    emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+    if (!emu)
+        return ERR_PTR(-ENOMEM);
+
+    spin_lock_init(&emu->lock);
+    emu->regs[ADXL345_REG_DEVID] = ADXL345_DEVID;
+    emu->regs[ADXL345_REG_BW_RATE] = ADXL345_OUTPUT_RATE_100HZ;
+    hrtimer_init(&emu->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    emu->timer.function = adxl345_emu_timer;
+
+    emu->irq = irq_create_mapping(adxl345_emu_domain, index);
+    if (!emu->irq) {
+        ret = -ENXIO;
+        goto free;
+    }
+    // irq_sim only takes edges: the drivers, which follow the firmware trigger type, get a rising
+    // one, raised when the pin goes high (adxl345_emu_update_line)
+    ret = irq_set_irq_type(emu->irq, IRQ_TYPE_EDGE_RISING);
+    if (ret)
+        goto dispose;
+
+    emu->adap.owner = THIS_MODULE;
+    emu->adap.algo = &adxl345_emu_algorithm;
+    snprintf(emu->adap.name, sizeof(emu->adap.name), "adxl345 emulator %u", index);
+    i2c_set_adapdata(&emu->adap, emu);
+    ret = i2c_add_adapter(&emu->adap);
+    if (ret)
+        goto dispose;
+
+    info.irq = emu->irq;
+    emu->client = i2c_new_client_device(&emu->adap, &info);
+    if (IS_ERR(emu->client)) {
+        ret = PTR_ERR(emu->client);
+        goto del;
+    }
+
+    return emu;
+
+del:
+    i2c_del_adapter(&emu->adap);
+dispose:
+    irq_dispose_mapping(emu->irq);
+free:
+    kfree(emu);
+    return ERR_PTR(ret);
+}
+
+static void adxl345_emu_destroy(struct adxl345_emu *emu)
+{
+    // The driver is unbound first, it may still talk to the device until then
+    i2c_unregister_device(emu->client);
+    i2c_del_adapter(&emu->adap);
+    hrtimer_cancel(&emu->timer);
+    irq_dispose_mapping(emu->irq);
+    kfree(emu);
+}
+
+static void adxl345_emu_cleanup(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < ADXL345_EMU_MAX; i++) {
+        if (adxl345_emus[i])
+            adxl345_emu_destroy(adxl345_emus[i]);
+        adxl345_emus[i] = NULL;
+    }
+    if (adxl345_emu_domain)
+        irq_domain_remove_sim(adxl345_emu_domain);
+    if (adxl345_emu_fwnode)
+        irq_domain_free_fwnode(adxl345_emu_fwnode);
+}
+
+static int __init adxl345_emu_init(void)
+{
+    struct adxl345_emu *emu;
+    unsigned int i;
+    int ret;
+
+    if (devices == 0 || devices > ADXL345_EMU_MAX)
+        return -EINVAL;
+
+    if (!strcmp(waveform, "static"))
+        adxl345_emu_waveform = ADXL345_EMU_STATIC;
+    else if (!strcmp(waveform, "sine"))
+        adxl345_emu_waveform = ADXL345_EMU_SINE;
+    else if (!strcmp(waveform, "noise"))
+        adxl345_emu_waveform = ADXL345_EMU_NOISE;
+    else
+        return -EINVAL;
+
+    adxl345_emu_fwnode = irq_domain_alloc_named_fwnode("adxl345_emu");
+    if (!adxl345_emu_fwnode)
+        return -ENOMEM;
+
+    adxl345_emu_domain = irq_domain_create_sim(adxl345_emu_fwnode, devices);
+    if (IS_ERR(adxl345_emu_domain)) {
+        ret = PTR_ERR(adxl345_emu_domain);
+        adxl345_emu_domain = NULL;
+        goto err;
+    }
+
+    for (i = 0; i < devices; i++) {
+        emu = adxl345_emu_create(i);
+        if (IS_ERR(emu)) {
+            ret = PTR_ERR(emu);
+            goto err;
+        }
+        adxl345_emus[i] = emu;
+    }
+
+    pr_info("%u emulated adxl345, %s waveform\n", devices, waveform);
+    return 0;
+
+err:
+    adxl345_emu_cleanup();
+    return ret;
+}
+
+static void __exit adxl345_emu_exit(void)
+{
+    adxl345_emu_cleanup();
+}
+
+module_init(adxl345_emu_init);
+module_exit(adxl345_emu_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("adxl345 emulator");
+MODULE_AUTHOR("Le-Trung NGUYEN");
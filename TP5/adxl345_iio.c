@@ -0,0 +1,515 @@
+// IIO variant of the adxl345 driver (TP5)
+// The x/y/z channels and a timestamp channel are exposed through the IIO buffer framework, filled
+// from the accelerometer FIFO on each watermark interrupt, so the standard IIO tools
+// (iio_generic_buffer, libiio...) can read whole scans in bulk from /dev/iio:deviceN.
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/of.h>
+#include <linux/i2c.h>
+#include <linux/interrupt.h>
+#include <linux/mutex.h>
+#include <linux/regmap.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/kfifo_buf.h>
+#include <linux/iio/sysfs.h>
+
+
+
+// Reference from https://www.analog.com/media/en/technical-documentation/data-sheets/adxl345.pdf (TP2)
+// Define the register addresses of adxl345: (TP2)
+#define ADXL345_REG_BW_RATE             0x2C
+#define ADXL345_REG_INT_ENABLE          0x2E
+#define ADXL345_REG_DATA_FORMAT         0x31
+#define ADXL345_REG_FIFO_CTL            0x38
+#define ADXL345_REG_POWER_CTL           0x2D
+
+// Define their values (TP2)
+#define ADXL345_OUTPUT_RATE_100HZ       0x0A
+#define ADXL345_ALL_INTERRUPTS_DISABLED 0x00
+#define ADXL345_DATA_FORMAT_DEFAULT     0x00
+#define ADXL345_FIFO_BYPASS_MODE        0x00
+#define ADXL345_MEASURE_MODE            0x08
+#define ADXL345_STANDBY_MODE            0x00
+
+#define ADXL345_DATAX0     0x32
+#define ADXL345_DATAY0     0x34
+#define ADXL345_DATAZ0     0x36
+#define ADXL345_DATAZ1     0x37
+
+// TP4
+#define ADXL345_REG_FIFO_STATUS 0x39
+#define ADXL345_REG_INT_SOURCE  0x30
+
+#define ADXL345_FIFO_ENTRIES_MASK 0x3F // FIFO_STATUS bits 0-5
+#define ADXL345_FIFO_DEPTH        32
+#define ADXL345_FIFO_WATERMARK    20   // Default samples field of FIFO_CTL
+#define ADXL345_FIFO_STREAM_MODE  0x80
+#define ADXL345_INT_WATERMARK     0x02
+#define ADXL345_MAX_FAILURES      8    // Interrupts in a row without a drain before the line is disabled
+
+// 3.9 mg/LSB in the default +/-2g 10-bit format, in m/s^2
+#define ADXL345_SCALE_MICRO       38246
+
+
+struct adxl345_iio {
+    struct i2c_client *client;
+    struct regmap *regmap;  // All register traffic but the FIFO drain
+    struct mutex lock;      // Serializes the configuration changes
+    u8 bw_rate;             // Value written to BW_RATE
+    u8 watermark;           // Samples field written to FIFO_CTL
+    s64 irq_timestamp;      // Time of the last watermark interrupt, in the IIO device clock
+    s64 next_timestamp;     // Due to the next FIFO entry, 0 until the first batch since the buffer was enabled
+    unsigned int failures;  // Interrupts in a row the FIFO could not be drained, only used by the IRQ thread
+    bool irq_off;           // The IRQ thread gave up and disabled the line, enabled again with the buffer
+
+    // One scan pushed to the buffer: x, y, z then the timestamp
+    struct {
+        __le16 channels[3];
+        s64 timestamp __aligned(8);
+    } scan;
+
+    struct i2c_msg msgs[2 * ADXL345_FIFO_DEPTH];
+    // The adapter may DMA to and from these (I2C_M_DMA_SAFE), so each one starts a cache line and
+    // nothing else shares its lines: reg_data comes last, and the structure is padded to a whole
+    // number of cache lines, which iio_priv aligns
+    u8 data_reg ____cacheline_aligned;
+    u8 reg_data[ADXL345_FIFO_DEPTH * 6] ____cacheline_aligned;
+};
+
+#define ADXL345_ACCEL_CHANNEL(index, reg, axis) {                   \
+    .type = IIO_ACCEL,                                              \
+    .modified = 1,                                                  \
+    .channel2 = IIO_MOD_##axis,                                     \
+    .address = reg,                                                 \
+    .info_mask_separate = BIT(IIO_CHAN_INFO_RAW),                   \
+    .info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),           \
+    .info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),        \
+    .scan_index = index,                                            \
+    .scan_type = {                                                  \
+        .sign = 's',                                                \
+        .realbits = 13,                                             \
+        .storagebits = 16,                                          \
+        .endianness = IIO_LE,                                       \
+    },                                                              \
+}
+
+static const struct iio_chan_spec adxl345_channels[] = {
+    ADXL345_ACCEL_CHANNEL(0, ADXL345_DATAX0, X),
+    ADXL345_ACCEL_CHANNEL(1, ADXL345_DATAY0, Y),
+    ADXL345_ACCEL_CHANNEL(2, ADXL345_DATAZ0, Z),
+    IIO_CHAN_SOFT_TIMESTAMP(3),
+};
+
+// A FIFO entry always holds the three axes
+static const unsigned long adxl345_scan_masks[] = { 0x7, 0 };
+
+
+// The data and status registers change on their own, everything else is configuration
+static bool adxl345_volatile_reg(struct device *dev, unsigned int reg)
+{
+    switch (reg) {
+        case ADXL345_REG_INT_SOURCE:
+        case ADXL345_DATAX0 ... ADXL345_DATAZ1:
+        case ADXL345_REG_FIFO_STATUS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The configuration registers are cached and filled by the probe-time writes
+static const struct regmap_config adxl345_regmap_config = {
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = ADXL345_REG_FIFO_STATUS,
+    .volatile_reg = adxl345_volatile_reg,
+    .cache_type = REGCACHE_FLAT,
+};
+
+// Write a configuration register, skipped when the cached value is already the right one
+static int adxl345_write_reg(struct adxl345_iio *adxl, unsigned int reg, unsigned int val)
+{
+    return regmap_update_bits(adxl->regmap, reg, 0xFF, val);
+}
+
+// Sample period in ns for a BW_RATE rate code: 3200 Hz for 0xF, halved by each step below
+static s64 adxl345_period_ns(u8 bw_rate)
+{
+    return 312500LL << (0xF - (bw_rate & 0xF));
+}
+
+// Pop num_samples entries (up to ADXL345_FIFO_DEPTH) from the accelerometer FIFO into adxl->reg_data, 6 bytes per entry
+// Each entry is a write(DATAX0)/read(6) pair joined by a repeated start, and all the pairs of a
+// batch go out in a single i2c_transfer, so the adapter is locked once per batch instead of per entry
+static int adxl345_drain_fifo(struct adxl345_iio *adxl, int num_samples)
+{
+    struct i2c_client *client = adxl->client;
+    const struct i2c_adapter_quirks *quirks = client->adapter->quirks;
+    struct i2c_msg *msgs = adxl->msgs;
+    int max_batch = num_samples;
+    int done = 0;
+    int batch;
+    int ret = 0;
+    int i;
+
+    // Some adapters cap the number of messages per transfer
+    if (quirks && quirks->max_num_msgs)
+        max_batch = max(quirks->max_num_msgs / 2, 1);
+
+    adxl->data_reg = ADXL345_DATAX0;
+    while (done < num_samples) {
+        batch = min(max_batch, num_samples - done);
+        for (i = 0; i < batch; i++) {
+            msgs[2 * i].addr = client->addr;
+            msgs[2 * i].flags = (client->flags & I2C_M_TEN) | I2C_M_DMA_SAFE;
+            msgs[2 * i].len = 1;
+            msgs[2 * i].buf = &adxl->data_reg;
+
+            msgs[2 * i + 1].addr = client->addr;
+            msgs[2 * i + 1].flags = (client->flags & I2C_M_TEN) | I2C_M_RD | I2C_M_DMA_SAFE;
+            msgs[2 * i + 1].len = 6;
+            msgs[2 * i + 1].buf = &adxl->reg_data[(done + i) * 6];
+        }
+
+        ret = i2c_transfer(client->adapter, msgs, 2 * batch);
+        if (ret < 0)
+            break;
+        // Only complete write/read pairs hold a valid entry
+        done += ret / 2;
+        if (ret != 2 * batch) {
+            ret = -EIO;
+            break;
+        }
+    }
+
+    // Report the entries we did get, they are already gone from the accelerometer FIFO
+    if (done == 0 && ret < 0)
+        return ret;
+    return done;
+}
+
+// Top half: only note when the watermark was reached, the scans are timestamped from it
+static irqreturn_t adxl345_irq(int irq, void *dev_id)
+{
+    struct iio_dev *indio_dev = dev_id;
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+
+    adxl->irq_timestamp = iio_get_time_ns(indio_dev);
+    return IRQ_WAKE_THREAD;
+}
+
+// Bottom half: drain the accelerometer FIFO into the IIO buffer
+static irqreturn_t adxl345_int(int irq, void *dev_id)
+{
+    struct iio_dev *indio_dev = dev_id;
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+    s64 period = adxl345_period_ns(adxl->bw_rate);
+    // The watermark-th entry was acquired when the interrupt fired, the others are one period apart.
+    // The top half may run again while we drain, keep the time of the interrupt that woke us up.
+    s64 timestamp = READ_ONCE(adxl->irq_timestamp) - (adxl->watermark - 1) * period;
+    s64 next = adxl->next_timestamp;
+    unsigned int fifo_status;
+    bool failed = false;
+    int num_samples;
+    int ret;
+    int i;
+
+    // Carry on from the last batch rather than from an interrupt time that came late, unless
+    // entries were lost in between (a gap of more than a batch) or the sample clock drifted early
+    if (next && next <= timestamp && timestamp - next <= adxl->watermark * period)
+        timestamp = next;
+
+    do {
+        if (regmap_read(adxl->regmap, ADXL345_REG_FIFO_STATUS, &fifo_status)) {
+            failed = true;
+            break;
+        }
+
+        num_samples = min_t(int, fifo_status & ADXL345_FIFO_ENTRIES_MASK, ADXL345_FIFO_DEPTH);
+        if (num_samples == 0)
+            break;
+
+        ret = adxl345_drain_fifo(adxl, num_samples);
+        if (ret <= 0) {
+            failed = true;
+            break;
+        }
+
+        for (i = 0; i < ret; i++) {
+            memcpy(adxl->scan.channels, &adxl->reg_data[i * 6], 6);
+            iio_push_to_buffers_with_timestamp(indio_dev, &adxl->scan, timestamp);
+            timestamp += period;
+        }
+
+        // A short read means the bus failed, don't spin on it
+        if (ret != num_samples) {
+            failed = true;
+            break;
+        }
+    } while (num_samples >= adxl->watermark);
+    adxl->next_timestamp = timestamp;
+
+    // The line stays asserted while the FIFO can't be drained: rather than handling it again and
+    // again, give up until the buffer is enabled again
+    adxl->failures = failed ? adxl->failures + 1 : 0;
+    if (adxl->failures >= ADXL345_MAX_FAILURES) {
+        mutex_lock(&adxl->lock);
+        disable_irq_nosync(irq);
+        adxl->irq_off = true;
+        mutex_unlock(&adxl->lock);
+        adxl->failures = 0;
+        dev_err(&adxl->client->dev, "FIFO drain keeps failing, interrupt disabled\n");
+    }
+
+    return IRQ_HANDLED;
+}
+
+
+// Program the FIFO and the watermark interrupt for the buffered mode, or back to bypass
+static int adxl345_set_fifo(struct adxl345_iio *adxl, bool enable)
+{
+    int ret;
+
+    if (!enable) {
+        ret = adxl345_write_reg(adxl, ADXL345_REG_INT_ENABLE, ADXL345_ALL_INTERRUPTS_DISABLED);
+        if (ret)
+            return ret;
+        return adxl345_write_reg(adxl, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_BYPASS_MODE);
+    }
+
+    ret = adxl345_write_reg(adxl, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_STREAM_MODE | adxl->watermark);
+    if (ret)
+        return ret;
+    return adxl345_write_reg(adxl, ADXL345_REG_INT_ENABLE, ADXL345_INT_WATERMARK);
+}
+
+static int adxl345_buffer_postenable(struct iio_dev *indio_dev)
+{
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+    int ret;
+
+    mutex_lock(&adxl->lock);
+    // The FIFO starts empty, the interrupts are off until then
+    adxl->next_timestamp = 0;
+    ret = adxl345_set_fifo(adxl, true);
+    if (!ret && adxl->irq_off) {
+        adxl->irq_off = false;
+        enable_irq(adxl->client->irq);
+    }
+    mutex_unlock(&adxl->lock);
+
+    return ret;
+}
+
+static int adxl345_buffer_predisable(struct iio_dev *indio_dev)
+{
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+    int ret;
+
+    mutex_lock(&adxl->lock);
+    ret = adxl345_set_fifo(adxl, false);
+    mutex_unlock(&adxl->lock);
+
+    return ret;
+}
+
+static const struct iio_buffer_setup_ops adxl345_buffer_ops = {
+    .postenable = adxl345_buffer_postenable,
+    .predisable = adxl345_buffer_predisable,
+};
+
+// buffer/hwfifo_watermark: trade interrupt rate against latency
+static int adxl345_set_watermark(struct iio_dev *indio_dev, unsigned int val)
+{
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+    int ret = 0;
+
+    val = clamp_t(unsigned int, val, 1, ADXL345_FIFO_DEPTH - 1);
+
+    mutex_lock(&adxl->lock);
+    adxl->watermark = val;
+    if (iio_buffer_enabled(indio_dev))
+        ret = adxl345_write_reg(adxl, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_STREAM_MODE | val);
+    mutex_unlock(&adxl->lock);
+
+    return ret;
+}
+
+
+static int adxl345_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan, int *val, int *val2, long mask)
+{
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+    __le16 data;
+    int ret;
+
+    switch (mask) {
+        case IIO_CHAN_INFO_RAW:
+            // The data registers belong to the FIFO while buffering
+            ret = iio_device_claim_direct_mode(indio_dev);
+            if (ret)
+                return ret;
+            ret = regmap_bulk_read(adxl->regmap, chan->address, &data, sizeof(data));
+            iio_device_release_direct_mode(indio_dev);
+            if (ret)
+                return ret;
+            *val = sign_extend32(le16_to_cpu(data), chan->scan_type.realbits - 1);
+            return IIO_VAL_INT;
+        case IIO_CHAN_INFO_SCALE:
+            *val = 0;
+            *val2 = ADXL345_SCALE_MICRO;
+            return IIO_VAL_INT_PLUS_MICRO;
+        case IIO_CHAN_INFO_SAMP_FREQ:
+            *val = 3200;
+            *val2 = 1 << (0xF - adxl->bw_rate);
+            return IIO_VAL_FRACTIONAL;
+        default:
+            return -EINVAL;
+    }
+}
+
+static int adxl345_write_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan, int val, int val2, long mask)
+{
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+    u64 freq_micro;
+    u8 rate;
+    int ret;
+
+    if (mask != IIO_CHAN_INFO_SAMP_FREQ)
+        return -EINVAL;
+    if (val < 0 || val2 < 0)
+        return -EINVAL;
+
+    // Highest rate code not above the requested frequency, 0.1 Hz at least
+    freq_micro = (u64)val * 1000000 + val2;
+    for (rate = 0xF; rate > 0; rate--)
+        if ((3200ULL * 1000000 >> (0xF - rate)) <= freq_micro)
+            break;
+
+    mutex_lock(&adxl->lock);
+    ret = adxl345_write_reg(adxl, ADXL345_REG_BW_RATE, rate);
+    if (!ret)
+        adxl->bw_rate = rate;
+    mutex_unlock(&adxl->lock);
+
+    return ret;
+}
+
+static const struct iio_info adxl345_info = {
+    .read_raw = adxl345_read_raw,
+    .write_raw = adxl345_write_raw,
+    .hwfifo_set_watermark = adxl345_set_watermark,
+};
+
+
+static int adxl345_probe(struct i2c_client *client, const struct i2c_device_id *id)
+{
+    struct iio_dev *indio_dev;
+    struct adxl345_iio *adxl;
+    int ret;
+
+    indio_dev = devm_iio_device_alloc(&client->dev, sizeof(*adxl));
+    if (!indio_dev)
+        return -ENOMEM;
+
+    adxl = iio_priv(indio_dev);
+    adxl->client = client;
+    adxl->regmap = devm_regmap_init_i2c(client, &adxl345_regmap_config);
+    if (IS_ERR(adxl->regmap))
+        return PTR_ERR(adxl->regmap);
+    adxl->bw_rate = ADXL345_OUTPUT_RATE_100HZ;
+    adxl->watermark = ADXL345_FIFO_WATERMARK;
+    mutex_init(&adxl->lock);
+    i2c_set_clientdata(client, indio_dev);
+
+    // Same configuration as the misc device driver, the FIFO is only enabled with the buffer
+    // These writes always reach the device and fill the cache
+    ret = regmap_write(adxl->regmap, ADXL345_REG_BW_RATE, adxl->bw_rate);
+    if (!ret)
+        ret = regmap_write(adxl->regmap, ADXL345_REG_INT_ENABLE, ADXL345_ALL_INTERRUPTS_DISABLED);
+    if (!ret)
+        ret = regmap_write(adxl->regmap, ADXL345_REG_DATA_FORMAT, ADXL345_DATA_FORMAT_DEFAULT);
+    if (!ret)
+        ret = regmap_write(adxl->regmap, ADXL345_REG_FIFO_CTL, ADXL345_FIFO_BYPASS_MODE);
+    if (!ret)
+        ret = regmap_write(adxl->regmap, ADXL345_REG_POWER_CTL, ADXL345_MEASURE_MODE);
+    if (ret) {
+        pr_err("Failed to probe ADXL345\n");
+        return ret;
+    }
+
+    indio_dev->name = "adxl345";
+    indio_dev->info = &adxl345_info;
+    indio_dev->channels = adxl345_channels;
+    indio_dev->num_channels = ARRAY_SIZE(adxl345_channels);
+    indio_dev->available_scan_masks = adxl345_scan_masks;
+    indio_dev->modes = INDIO_DIRECT_MODE;
+
+    ret = devm_iio_kfifo_buffer_setup(&client->dev, indio_dev, INDIO_BUFFER_SOFTWARE, &adxl345_buffer_ops);
+    if (ret)
+        return ret;
+
+    ret = devm_request_threaded_irq(&client->dev, client->irq, adxl345_irq, adxl345_int, IRQF_ONESHOT, "adxl345_iio", indio_dev);
+    if (ret) {
+        pr_err("Failed to register IRQ handler\n");
+        return ret;
+    }
+
+    ret = devm_iio_device_register(&client->dev, indio_dev);
+    if (ret)
+        return ret;
+
+    pr_info("Successfully probe adxl345 (IIO)\n");
+    return 0;
+}
+
+
+static int adxl345_remove(struct i2c_client *client)
+{
+    struct iio_dev *indio_dev = i2c_get_clientdata(client);
+    struct adxl345_iio *adxl = iio_priv(indio_dev);
+    int ret;
+
+    // Switch to standby mode in POWER_CTL register
+    // The device gets unbound whatever is returned, the rest is device-managed
+    ret = adxl345_write_reg(adxl, ADXL345_REG_POWER_CTL, ADXL345_STANDBY_MODE);
+    if (ret)
+        dev_err(&client->dev, "Failed to switch to standby mode: %d\n", ret);
+
+    pr_info("Successfully remove!\n\n");
+    return 0;
+}
+
+
+static struct i2c_device_id adxl345_idtable[] = {
+    { "adxl345", 0 },
+    { }
+};
+MODULE_DEVICE_TABLE(i2c, adxl345_idtable);
+
+#ifdef CONFIG_OF
+static const struct of_device_id adxl345_of_match[] = {
+    {   .compatible = "qemu,adxl345",
+        .data       = NULL },
+    {}
+};
+
+MODULE_DEVICE_TABLE(of, adxl345_of_match);
+#endif
+
+static struct i2c_driver adxl345_driver = {
+        .driver = {
+        .name           = "adxl345_iio",
+        .of_match_table = of_match_ptr(adxl345_of_match),
+    },
+    .id_table   = adxl345_idtable,
+    .probe      = adxl345_probe,
+    .remove     = adxl345_remove,
+};
+
+module_i2c_driver(adxl345_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("adxl345 IIO driver");
+MODULE_AUTHOR("Le-Trung NGUYEN");
@@ -0,0 +1,134 @@
+// Tracepoints of the adxl345 driver, from the watermark interrupt to the application (TP5)
+// Enabled with ftrace (/sys/kernel/tracing/events/adxl345/) or perf (-e 'adxl345:*'), they cost
+// nothing otherwise. All of them carry the name of the misc device, adxl345-N.
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM adxl345
+
+#if !defined(_ADXL345_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ADXL345_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+// Top half of the watermark interrupt, timestamp is when it ran: the IRQ thread gives it to the
+// watermark-th entry of the FIFO and spaces the others one sample period apart from there, unless
+// the batch follows on from the previous one, whose timestamps it then continues
+TRACE_EVENT(adxl345_irq,
+    TP_PROTO(struct device *dev, u64 timestamp),
+    TP_ARGS(dev, timestamp),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u64, timestamp)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->timestamp = timestamp;
+    ),
+    TP_printk("%s timestamp=%llu", __get_str(dev), __entry->timestamp)
+);
+
+// INT_SOURCE and the number of entries in the accelerometer FIFO, read before each drain
+TRACE_EVENT(adxl345_fifo_status,
+    TP_PROTO(struct device *dev, unsigned int int_source, int entries),
+    TP_ARGS(dev, int_source, entries),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(unsigned int, int_source)
+        __field(int, entries)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->int_source = int_source;
+        __entry->entries = entries;
+    ),
+    TP_printk("%s int_source=0x%02x entries=%d", __get_str(dev), __entry->int_source, __entry->entries)
+);
+
+// End of the I2C burst draining the FIFO: bytes read, time spent in i2c_transfer, error if any
+TRACE_EVENT(adxl345_drain,
+    TP_PROTO(struct device *dev, int bytes, u64 duration_ns, int ret),
+    TP_ARGS(dev, bytes, duration_ns, ret),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(int, bytes)
+        __field(u64, duration_ns)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->bytes = bytes;
+        __entry->duration_ns = duration_ns;
+        __entry->ret = ret;
+    ),
+    TP_printk("%s bytes=%d duration_ns=%llu ret=%d", __get_str(dev), __entry->bytes, __entry->duration_ns,
+              __entry->ret)
+);
+
+// Samples published in the ring, depth is how many the slowest reader has not read yet
+TRACE_EVENT(adxl345_enqueue,
+    TP_PROTO(struct device *dev, u32 samples, u32 dropped, u32 head, u32 depth),
+    TP_ARGS(dev, samples, dropped, head, depth),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u32, samples)
+        __field(u32, dropped)
+        __field(u32, head)
+        __field(u32, depth)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->samples = samples;
+        __entry->dropped = dropped;
+        __entry->head = head;
+        __entry->depth = depth;
+    ),
+    TP_printk("%s samples=%u dropped=%u head=%u depth=%u", __get_str(dev), __entry->samples, __entry->dropped,
+              __entry->head, __entry->depth)
+);
+
+// The IRQ thread wakes the readers up, lowat samples being queued
+TRACE_EVENT(adxl345_wakeup,
+    TP_PROTO(struct device *dev, u32 head, unsigned int lowat),
+    TP_ARGS(dev, head, lowat),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u32, head)
+        __field(unsigned int, lowat)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->head = head;
+        __entry->lowat = lowat;
+    ),
+    TP_printk("%s head=%u lowat=%u", __get_str(dev), __entry->head, __entry->lowat)
+);
+
+// A reader took samples out of the ring: latency_ns is the age of the oldest one, from its
+// acquisition by the accelerometer to now
+TRACE_EVENT(adxl345_dequeue,
+    TP_PROTO(struct device *dev, unsigned int samples, u32 cursor, u64 timestamp),
+    TP_ARGS(dev, samples, cursor, timestamp),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(unsigned int, samples)
+        __field(u32, cursor)
+        __field(u64, latency_ns)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->samples = samples;
+        __entry->cursor = cursor;
+        __entry->latency_ns = ktime_get_boottime_ns() - timestamp;
+    ),
+    TP_printk("%s samples=%u cursor=%u latency_ns=%llu", __get_str(dev), __entry->samples, __entry->cursor,
+              __entry->latency_ns)
+);
+
+#endif
+
+// The header isn't in include/trace/events/, the Makefile adds its directory: CFLAGS_adxl345_TP5.o := -I$(src)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE adxl345_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,291 @@
+// Throughput and loss benchmark of the adxl345 driver (TP5)
+// Streams whole records from one or more /dev/adxl345-N for a fixed duration, with as many reader
+// threads per device as asked, then reports samples/s, syscalls per sample, CPU time and loss.
+//   ./bench -d /dev/adxl345-0 -d /dev/adxl345-1 -t 10 -o 3200000 -w 31 -b 64 -j 2
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "adxl345.h"
+
+#define MAX_DEVICES 16
+#define MAX_THREADS 64
+
+struct reader {
+    const char *path;
+    pthread_t thread;
+    unsigned long long samples;
+    unsigned long long syscalls;
+    unsigned long long overruns; // Samples this file lost
+    int error;
+};
+
+static unsigned int duration = 10;   // Seconds
+static unsigned int batch = 32;      // Samples per read()
+static unsigned int lowat = 1;
+static struct timespec deadline;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int past_deadline(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec > deadline.tv_sec || (ts.tv_sec == deadline.tv_sec && ts.tv_nsec >= deadline.tv_nsec);
+}
+
+// Driver counter from /sys/class/misc/adxl345-N/, -1 if missing
+static long long read_counter(const char *path, const char *name)
+{
+    char copy[256];
+    char file[512];
+    long long val = -1;
+    FILE *f;
+
+    snprintf(copy, sizeof(copy), "%s", path);
+    snprintf(file, sizeof(file), "/sys/class/misc/%s/%s", basename(copy), name);
+    f = fopen(file, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%lld", &val) != 1)
+        val = -1;
+    fclose(f);
+    return val;
+}
+
+// Program the output data rate, range and watermark, only the given ones
+static int configure(const char *path, unsigned int odr_mhz, unsigned int range_g, unsigned int watermark)
+{
+    struct adxl345_config cfg;
+    int fd = open(path, O_RDONLY);
+    int ret = 0;
+
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    if (ioctl(fd, ADXL_IOCTL_GET_CONFIG, &cfg) == -1) {
+        perror("ADXL_IOCTL_GET_CONFIG");
+        ret = -1;
+    } else {
+        if (odr_mhz)
+            cfg.odr_mhz = odr_mhz;
+        if (range_g)
+            cfg.range_g = range_g;
+        if (watermark)
+            cfg.watermark = watermark;
+        if (ioctl(fd, ADXL_IOCTL_SET_CONFIG, &cfg) == -1) {
+            perror("ADXL_IOCTL_SET_CONFIG");
+            ret = -1;
+        } else if (ioctl(fd, ADXL_IOCTL_GET_CONFIG, &cfg) == 0) {
+            printf("%s: %u mHz, +/-%u g, watermark %u\n", path, cfg.odr_mhz, cfg.range_g, cfg.watermark);
+        }
+    }
+
+    close(fd);
+    return ret;
+}
+
+// One reader: poll() then read() whole records until the deadline
+static void *reader_main(void *arg)
+{
+    struct reader *r = arg;
+    struct fifo_element *buf;
+    struct pollfd pfd;
+    __u32 lw = lowat;
+    __u64 overruns = 0;
+    ssize_t ret;
+
+    buf = malloc(batch * sizeof(*buf));
+    pfd.fd = open(r->path, O_RDONLY | O_NONBLOCK);
+    if (!buf || pfd.fd == -1) {
+        r->error = errno;
+        free(buf);
+        return NULL;
+    }
+    pfd.events = POLLIN;
+
+    if (ioctl(pfd.fd, ADXL_IOCTL_SET_AXIS_ALL) == -1 || ioctl(pfd.fd, ADXL_IOCTL_SET_LOWAT, &lw) == -1) {
+        r->error = errno;
+        goto out;
+    }
+
+    while (!past_deadline()) {
+        // Wake up now and then to check the deadline, whatever the rate
+        ret = poll(&pfd, 1, 100);
+        r->syscalls++;
+        if (ret <= 0)
+            continue;
+
+        ret = read(pfd.fd, buf, batch * sizeof(*buf));
+        r->syscalls++;
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            r->error = errno;
+            break;
+        }
+        r->samples += ret / sizeof(*buf);
+    }
+
+    if (ioctl(pfd.fd, ADXL_IOCTL_GET_OVERRUNS, &overruns) == 0)
+        r->overruns = overruns;
+
+out:
+    close(pfd.fd);
+    free(buf);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device]... [-t seconds] [-o odr_mhz] [-r range_g] [-w watermark] [-b samples] [-l lowat] [-j threads]\n"
+            "  -d  device to read, repeat for several (default /dev/adxl345-0)\n"
+            "  -t  duration of the run in seconds (default 10)\n"
+            "  -o  output data rate in mHz, e.g. 3200000 (default: unchanged)\n"
+            "  -r  range in g: 2, 4, 8 or 16 (default: unchanged)\n"
+            "  -w  watermark, samples per interrupt (default: unchanged)\n"
+            "  -b  samples per read() (default 32)\n"
+            "  -l  samples queued before a reader is woken up (default 1)\n"
+            "  -j  reader threads per device (default 1)\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *devices[MAX_DEVICES];
+    struct reader readers[MAX_THREADS];
+    unsigned int num_devices = 0;
+    unsigned int threads = 1;
+    unsigned int odr_mhz = 0, range_g = 0, watermark = 0;
+    long long hw_before[MAX_DEVICES], drop_before[MAX_DEVICES];
+    unsigned long long samples = 0, syscalls = 0, overruns = 0;
+    struct rusage ru;
+    double start, elapsed, cpu;
+    unsigned int i, j, n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:o:r:w:b:l:j:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                if (num_devices == MAX_DEVICES) {
+                    fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+                    return EXIT_FAILURE;
+                }
+                devices[num_devices++] = optarg;
+                break;
+            case 't':
+                duration = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                odr_mhz = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                range_g = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                watermark = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                lowat = strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (num_devices == 0)
+        devices[num_devices++] = "/dev/adxl345-0";
+    if (duration == 0 || batch == 0 || lowat == 0 || threads == 0 || num_devices * threads > MAX_THREADS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The configuration can only shrink or grow the ring while nobody reads, so do it first
+    for (i = 0; i < num_devices; i++) {
+        if ((odr_mhz || range_g || watermark) && configure(devices[i], odr_mhz, range_g, watermark))
+            return EXIT_FAILURE;
+        hw_before[i] = read_counter(devices[i], "overruns");
+        drop_before[i] = read_counter(devices[i], "dropped");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += duration;
+    start = now();
+
+    n = 0;
+    for (i = 0; i < num_devices; i++) {
+        for (j = 0; j < threads; j++, n++) {
+            memset(&readers[n], 0, sizeof(readers[n]));
+            readers[n].path = devices[i];
+            if (pthread_create(&readers[n].thread, NULL, reader_main, &readers[n])) {
+                fprintf(stderr, "Failed to start a reader thread\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    for (i = 0; i < n; i++)
+        pthread_join(readers[i].thread, NULL);
+
+    elapsed = now() - start;
+    getrusage(RUSAGE_SELF, &ru);
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+    printf("%-20s %8s %12s %12s %10s %10s %10s\n", "device", "thread", "samples", "samples/s", "syscalls", "sys/smp", "lost");
+    for (i = 0; i < n; i++) {
+        struct reader *r = &readers[i];
+
+        if (r->error) {
+            fprintf(stderr, "%s: %s\n", r->path, strerror(r->error));
+            return EXIT_FAILURE;
+        }
+        printf("%-20s %8u %12llu %12.1f %10llu %10.3f %10llu\n", r->path, i % threads, r->samples,
+               r->samples / elapsed, r->syscalls, r->samples ? (double)r->syscalls / r->samples : 0.0, r->overruns);
+        samples += r->samples;
+        syscalls += r->syscalls;
+        overruns += r->overruns;
+    }
+
+    printf("\n");
+    printf("duration:           %.3f s\n", elapsed);
+    printf("samples:            %llu (%.1f/s)\n", samples, samples / elapsed);
+    printf("syscalls/sample:    %.3f\n", samples ? (double)syscalls / samples : 0.0);
+    printf("cpu:                %.3f s (%.1f%%, %.0f ns/sample)\n", cpu, 100 * cpu / elapsed,
+           samples ? cpu * 1e9 / samples : 0.0);
+    printf("lost by readers:    %llu\n", overruns);
+    for (i = 0; i < num_devices; i++) {
+        long long hw = read_counter(devices[i], "overruns");
+        long long drop = read_counter(devices[i], "dropped");
+
+        if (hw >= 0 && hw_before[i] >= 0)
+            printf("%s: FIFO overruns %lld, ring drops %lld\n", devices[i], hw - hw_before[i],
+                   drop >= 0 && drop_before[i] >= 0 ? drop - drop_before[i] : -1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,296 @@
+// End-to-end latency benchmark of the adxl345 driver (TP5)
+// Every record carries the CLOCK_BOOTTIME at which the accelerometer acquired it (interpolated from
+// the watermark interrupt), so the age of each sample when read() returns it is its delivery latency.
+// Sweeps output data rates and watermarks, optionally with background CPU load, and reports the
+// latency percentiles and the jitter of the intervals between deliveries.
+//   ./latency -o 100000,800000,3200000 -w 1,16,31 -t 5 -L 4
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/ioctl.h>
+
+#include "adxl345.h"
+
+#define MAX_VALUES 16
+
+// Growable array of durations in ns
+struct series {
+    uint64_t *v;
+    size_t n;
+    size_t cap;
+};
+
+static volatile int load_stop;
+
+static uint64_t boottime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int series_add(struct series *s, uint64_t v)
+{
+    uint64_t *p;
+
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 4096;
+        p = realloc(s->v, s->cap * sizeof(*p));
+        if (!p)
+            return -1;
+        s->v = p;
+    }
+    s->v[s->n++] = v;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Percentile of a sorted series, in us, 0 when empty
+static double pct(const struct series *s, double p)
+{
+    size_t i;
+
+    if (!s->n)
+        return 0;
+    i = (size_t)(p / 100 * (s->n - 1) + 0.5);
+    return s->v[i] / 1e3;
+}
+
+static double stddev_us(const struct series *s)
+{
+    double mean = 0, var = 0;
+    size_t i;
+
+    if (s->n < 2)
+        return 0;
+    for (i = 0; i < s->n; i++)
+        mean += s->v[i];
+    mean /= s->n;
+    for (i = 0; i < s->n; i++)
+        var += (s->v[i] - mean) * (s->v[i] - mean);
+    return sqrt(var / (s->n - 1)) / 1e3;
+}
+
+// Comma separated list of numbers
+static int parse_list(char *arg, unsigned int *values)
+{
+    char *tok;
+    int n = 0;
+
+    for (tok = strtok(arg, ","); tok && n < MAX_VALUES; tok = strtok(NULL, ","))
+        values[n++] = strtoul(tok, NULL, 0);
+    return n;
+}
+
+// Background load: spin until told to stop
+static void *load_main(void *arg)
+{
+    volatile unsigned long x = 0;
+
+    (void)arg;
+    while (!load_stop)
+        x++;
+    return NULL;
+}
+
+// Read records for duration seconds, latency of every sample and interval between deliveries
+static int measure(int fd, unsigned int duration, struct series *latency, struct series *interval)
+{
+    struct fifo_element buf[64];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t end = boottime_ns() + duration * 1000000000ULL;
+    uint64_t last = 0;
+    uint64_t t;
+    ssize_t ret;
+    size_t i;
+
+    while (boottime_ns() < end) {
+        ret = poll(&pfd, 1, 100);
+        if (ret <= 0)
+            continue;
+        ret = read(fd, buf, sizeof(buf));
+        t = boottime_ns();
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            perror("read");
+            return -1;
+        }
+        if (ret == 0)
+            continue;
+
+        for (i = 0; i < ret / sizeof(buf[0]); i++)
+            if (series_add(latency, t - buf[i].timestamp))
+                return -1;
+        if (last && series_add(interval, t - last))
+            return -1;
+        last = t;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device] [-o odr_mhz,...] [-w watermark,...] [-t seconds] [-l lowat] [-a latency_us] [-L threads] [-p priority]\n"
+            "  -d  device (default /dev/adxl345-0)\n"
+            "  -o  output data rates to sweep, in mHz (default: unchanged)\n"
+            "  -w  watermarks to sweep (default: unchanged)\n"
+            "  -t  measurement per setting, in seconds (default 5)\n"
+            "  -l  samples queued before the reader is woken up (default 1)\n"
+            "  -a  latency budget of the adaptive watermark, in us (default: fixed watermark)\n"
+            "  -L  busy threads loading the CPUs meanwhile (default 0)\n"
+            "  -p  SCHED_FIFO priority of the reader (default: normal scheduling)\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "/dev/adxl345-0";
+    unsigned int odrs[MAX_VALUES], watermarks[MAX_VALUES];
+    int num_odrs = 0, num_watermarks = 0;
+    unsigned int duration = 5, load = 0;
+    __u32 lowat = 1, latency_us = 0;
+    int priority = 0;
+    pthread_t load_threads[64];
+    struct adxl345_config cfg, orig;
+    struct series latency = { 0 }, interval = { 0 };
+    struct fifo_element discard[64];
+    struct sched_param sp;
+    uint64_t settle;
+    unsigned int i;
+    int o, w;
+    int fd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:o:w:t:l:a:L:p:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                path = optarg;
+                break;
+            case 'o':
+                num_odrs = parse_list(optarg, odrs);
+                break;
+            case 'w':
+                num_watermarks = parse_list(optarg, watermarks);
+                break;
+            case 't':
+                duration = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                lowat = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                latency_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'L':
+                load = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                priority = strtol(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (duration == 0 || lowat == 0 || load > 64) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd == -1) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    if (ioctl(fd, ADXL_IOCTL_SET_AXIS_ALL) == -1 || ioctl(fd, ADXL_IOCTL_SET_LOWAT, &lowat) == -1 ||
+        ioctl(fd, ADXL_IOCTL_GET_CONFIG, &orig) == -1) {
+        perror("ioctl");
+        return EXIT_FAILURE;
+    }
+    if (latency_us && ioctl(fd, ADXL_IOCTL_SET_LATENCY, &latency_us) == -1) {
+        perror("ADXL_IOCTL_SET_LATENCY");
+        return EXIT_FAILURE;
+    }
+
+    if (priority) {
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1)
+            perror("sched_setscheduler");
+    }
+
+    load_stop = 0;
+    for (i = 0; i < load; i++)
+        pthread_create(&load_threads[i], NULL, load_main, NULL);
+
+    if (!num_odrs)
+        odrs[num_odrs++] = orig.odr_mhz;
+    if (!num_watermarks)
+        watermarks[num_watermarks++] = orig.watermark;
+
+    printf("%10s %4s %10s %10s %10s %10s %10s %12s %12s\n", "odr_mhz", "wm", "samples", "p50_us", "p99_us",
+           "p99.9_us", "max_us", "interval_us", "jitter_us");
+    for (o = 0; o < num_odrs; o++) {
+        for (w = 0; w < num_watermarks; w++) {
+            cfg = orig;
+            cfg.odr_mhz = odrs[o];
+            cfg.watermark = watermarks[w];
+            if (ioctl(fd, ADXL_IOCTL_SET_CONFIG, &cfg) == -1 || ioctl(fd, ADXL_IOCTL_GET_CONFIG, &cfg) == -1) {
+                fprintf(stderr, "%u mHz, watermark %u: %s\n", odrs[o], watermarks[w], strerror(errno));
+                continue;
+            }
+
+            // Drop the samples acquired with the previous setting
+            settle = boottime_ns() + 200000000ULL;
+            while (boottime_ns() < settle)
+                if (read(fd, discard, sizeof(discard)) <= 0)
+                    usleep(1000);
+
+            latency.n = 0;
+            interval.n = 0;
+            if (measure(fd, duration, &latency, &interval))
+                return EXIT_FAILURE;
+            qsort(latency.v, latency.n, sizeof(*latency.v), cmp_u64);
+            qsort(interval.v, interval.n, sizeof(*interval.v), cmp_u64);
+
+            printf("%10u %4u %10zu %10.1f %10.1f %10.1f %10.1f %12.1f %12.1f\n", cfg.odr_mhz, cfg.watermark, latency.n,
+                   pct(&latency, 50), pct(&latency, 99), pct(&latency, 99.9), latency.n ? latency.v[latency.n - 1] / 1e3 : 0,
+                   pct(&interval, 50), stddev_us(&interval));
+            fflush(stdout);
+        }
+    }
+
+    load_stop = 1;
+    for (i = 0; i < load; i++)
+        pthread_join(load_threads[i], NULL);
+
+    // Leave the device as we found it
+    if (latency_us) {
+        latency_us = 0;
+        ioctl(fd, ADXL_IOCTL_SET_LATENCY, &latency_us);
+    }
+    ioctl(fd, ADXL_IOCTL_SET_CONFIG, &orig);
+
+    close(fd);
+    free(latency.v);
+    free(interval.v);
+    return 0;
+}
@@ -0,0 +1,281 @@
+// Client library of the adxl345 driver (TP5), see libadxl345.h
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "libadxl345.h"
+
+struct adxl345_dev {
+    int fd;
+    int flags;
+    // ADXL345_OPEN_MMAP
+    struct adxl345_ring *ring;
+    struct fifo_element *data;
+    size_t map_len;
+    __u32 tail;          // Next record of this process: other processes may map the same ring
+    __u32 slot;          // Where the driver finds it, in ring->tails
+    unsigned long long overruns;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+int adxl345_list(char paths[][ADXL345_PATH_MAX], int max)
+{
+    struct dirent *de;
+    int numbers[256];
+    int count = 0;
+    int n;
+    int i;
+    DIR *dir;
+
+    dir = opendir("/dev");
+    if (!dir)
+        return -errno;
+    while ((de = readdir(dir)) && count < (int)(sizeof(numbers) / sizeof(numbers[0])))
+        if (sscanf(de->d_name, "adxl345-%d", &n) == 1)
+            numbers[count++] = n;
+    closedir(dir);
+
+    // adxl345-10 comes after adxl345-9
+    qsort(numbers, count, sizeof(numbers[0]), cmp_int);
+    for (i = 0; i < count && i < max; i++)
+        snprintf(paths[i], ADXL345_PATH_MAX, "/dev/adxl345-%d", numbers[i]);
+    return count;
+}
+
+// Map the ring: its header tells how big the whole mapping is
+static int map_ring(struct adxl345_dev *dev)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct adxl345_ring *header;
+    size_t len;
+    int ret;
+
+    header = mmap(NULL, page, PROT_READ, MAP_SHARED, dev->fd, 0);
+    if (header == MAP_FAILED)
+        return -errno;
+    len = header->data_offset + (size_t)header->size * sizeof(struct fifo_element);
+    munmap(header, page);
+
+    len = (len + page - 1) / page * page;
+    dev->ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->ring == MAP_FAILED) {
+        dev->ring = NULL;
+        return -errno;
+    }
+    dev->map_len = len;
+    dev->data = (struct fifo_element *)((char *)dev->ring + dev->ring->data_offset);
+    // The driver starts the slot at head: only the samples acquired from now on, as with read().
+    // poll() on the file then follows the position published there.
+    if (ioctl(dev->fd, ADXL_IOCTL_RING_SLOT, &dev->slot) == -1) {
+        ret = -errno;
+        munmap(dev->ring, len);
+        dev->ring = NULL;
+        return ret;
+    }
+    dev->tail = __atomic_load_n(&dev->ring->tails[dev->slot], __ATOMIC_RELAXED);
+    return 0;
+}
+
+struct adxl345_dev *adxl345_open(const char *path, int flags)
+{
+    char first[1][ADXL345_PATH_MAX];
+    struct adxl345_dev *dev;
+    int ret;
+
+    if (!path) {
+        ret = adxl345_list(first, 1);
+        if (ret <= 0) {
+            errno = ret ? -ret : ENODEV;
+            return NULL;
+        }
+        path = first[0];
+    }
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return NULL;
+    dev->flags = flags;
+
+    // Non-blocking: adxl345_read_samples does the waiting, with its timeout
+    dev->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (dev->fd == -1) {
+        ret = -errno;
+        goto err;
+    }
+    if (ioctl(dev->fd, ADXL_IOCTL_SET_AXIS_ALL) == -1) {
+        ret = -errno;
+        goto err;
+    }
+    if (flags & ADXL345_OPEN_MMAP) {
+        ret = map_ring(dev);
+        if (ret)
+            goto err;
+    }
+    return dev;
+
+err:
+    if (dev->fd != -1)
+        close(dev->fd);
+    free(dev);
+    errno = -ret;
+    return NULL;
+}
+
+void adxl345_close(struct adxl345_dev *dev)
+{
+    if (!dev)
+        return;
+    if (dev->ring)
+        munmap(dev->ring, dev->map_len);
+    close(dev->fd);
+    free(dev);
+}
+
+int adxl345_fd(const struct adxl345_dev *dev)
+{
+    return dev->fd;
+}
+
+int adxl345_get_config(struct adxl345_dev *dev, struct adxl345_config *cfg)
+{
+    return ioctl(dev->fd, ADXL_IOCTL_GET_CONFIG, cfg) == -1 ? -errno : 0;
+}
+
+int adxl345_set_config(struct adxl345_dev *dev, const struct adxl345_config *cfg)
+{
+    return ioctl(dev->fd, ADXL_IOCTL_SET_CONFIG, cfg) == -1 ? -errno : 0;
+}
+
+int adxl345_set_latency(struct adxl345_dev *dev, unsigned int latency_us)
+{
+    __u32 val = latency_us;
+
+    return ioctl(dev->fd, ADXL_IOCTL_SET_LATENCY, &val) == -1 ? -errno : 0;
+}
+
+int adxl345_calibrate(struct adxl345_dev *dev, unsigned int samples, signed char offset[3])
+{
+    struct adxl345_calibration calib;
+
+    memset(&calib, 0, sizeof(calib));
+    calib.samples = samples;
+    if (ioctl(dev->fd, ADXL_IOCTL_CALIBRATE, &calib) == -1)
+        return -errno;
+    if (offset)
+        memcpy(offset, calib.offset, sizeof(calib.offset));
+    return 0;
+}
+
+int adxl345_set_lowat(struct adxl345_dev *dev, unsigned int lowat)
+{
+    __u32 val = lowat;
+
+    return ioctl(dev->fd, ADXL_IOCTL_SET_LOWAT, &val) == -1 ? -errno : 0;
+}
+
+// Copy up to max samples out of the mapped ring, following the protocol of adxl345.h
+// The position is private to this process, so that every process mapping the ring gets every
+// sample. It is only published to the slot of this process for the drop-newest policy.
+static size_t ring_take(struct adxl345_dev *dev, struct fifo_element *samples, size_t max)
+{
+    __u32 size = dev->ring->size;
+    __u32 usable = size - ADXL345_RING_GUARD;
+    __u32 tail = dev->tail;
+    __u32 head;
+    __u32 n;
+    __u32 i;
+
+    for (;;) {
+        head = __atomic_load_n(&dev->ring->head, __ATOMIC_ACQUIRE);
+        // Fell behind: the oldest records are being overwritten
+        if (head - tail > usable) {
+            dev->overruns += head - tail - usable;
+            tail = head - usable;
+        }
+
+        n = head - tail < max ? head - tail : max;
+        for (i = 0; i < n; i++)
+            samples[i] = dev->data[(tail + i) & (size - 1)];
+
+        // Still valid if the driver didn't move into them while we were copying
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&dev->ring->head, __ATOMIC_RELAXED) - tail <= usable)
+            break;
+    }
+
+    dev->tail = tail + n;
+    __atomic_store_n(&dev->ring->tails[dev->slot], dev->tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+ssize_t adxl345_read_samples(struct adxl345_dev *dev, struct fifo_element *samples, size_t max, int timeout_ms)
+{
+    long long deadline = timeout_ms > 0 ? now_ns() + timeout_ms * 1000000LL : 0;
+    long long left = -1;
+    struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+    ssize_t ret;
+    size_t n;
+
+    if (max == 0)
+        return 0;
+
+    for (;;) {
+        if (dev->ring) {
+            n = ring_take(dev, samples, max);
+            if (n)
+                return n;
+        } else {
+            ret = read(dev->fd, samples, max * sizeof(*samples));
+            if (ret >= 0)
+                return ret / sizeof(*samples);
+            if (errno != EAGAIN && errno != EINTR)
+                return -errno;
+        }
+
+        if (timeout_ms == 0)
+            return 0;
+        if (timeout_ms > 0) {
+            left = deadline - now_ns();
+            if (left <= 0)
+                return 0;
+        }
+
+        // Also for the ring: the driver reports the file readable against the position in its slot
+        ret = poll(&pfd, 1, left < 0 ? -1 : (int)((left + 999999) / 1000000));
+        if (ret == -1 && errno != EINTR)
+            return -errno;
+        // Unbound: read() reports it, the ring just stops moving
+        if (ret > 0 && dev->ring && pfd.revents & (POLLHUP | POLLERR))
+            return -ENODEV;
+    }
+}
+
+unsigned long long adxl345_overruns(struct adxl345_dev *dev)
+{
+    __u64 overruns = 0;
+
+    if (dev->ring)
+        return dev->overruns;
+    ioctl(dev->fd, ADXL_IOCTL_GET_OVERRUNS, &overruns);
+    return overruns;
+}
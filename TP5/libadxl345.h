@@ -0,0 +1,60 @@
+// Client library of the adxl345 driver (TP5)
+// Finds the accelerometers, configures them and reads whole timestamped samples in batches, either
+// with read() or straight from the ring mapped with mmap(), so applications don't have to redo it.
+// The ioctl numbers and structures come from adxl345.h. C++ code can use libadxl345.hpp instead.
+#ifndef LIBADXL345_H
+#define LIBADXL345_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "adxl345.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ADXL345_PATH_MAX 64
+
+// adxl345_open() flags
+// Read the samples from the mapped ring instead of with read(). Every device opened this way keeps
+// its own position in it, published in its own slot of the header, so several of them can read the
+// same accelerometer, and the drop-newest policy waits for the slowest one.
+#define ADXL345_OPEN_MMAP 0x1
+
+struct adxl345_dev;
+
+// Paths of the accelerometers present, /dev/adxl345-N in increasing N
+// Returns how many there are, which may be more than max, or -errno
+int adxl345_list(char paths[][ADXL345_PATH_MAX], int max);
+
+// Open an accelerometer, NULL for the first one. Returns NULL with errno set on failure.
+struct adxl345_dev *adxl345_open(const char *path, int flags);
+void adxl345_close(struct adxl345_dev *dev);
+
+// File descriptor, for poll() or epoll along with other sources, in both modes
+int adxl345_fd(const struct adxl345_dev *dev);
+
+// Configuration, shared by all the users of the accelerometer. All of these return 0 or -errno.
+int adxl345_get_config(struct adxl345_dev *dev, struct adxl345_config *cfg);
+int adxl345_set_config(struct adxl345_dev *dev, const struct adxl345_config *cfg);
+// Adaptive watermark delivering each sample within latency_us, 0 for the fixed watermark
+int adxl345_set_latency(struct adxl345_dev *dev, unsigned int latency_us);
+// Self-calibration at rest, flat with Z up, returns the offsets programmed in offset if not NULL
+int adxl345_calibrate(struct adxl345_dev *dev, unsigned int samples, signed char offset[3]);
+
+// Wake up only once lowat samples are queued (read() mode)
+int adxl345_set_lowat(struct adxl345_dev *dev, unsigned int lowat);
+
+// Read up to max samples, waiting at most timeout_ms for the first ones (-1: forever, 0: not at all)
+// Returns the number of samples, 0 on timeout, or -errno
+ssize_t adxl345_read_samples(struct adxl345_dev *dev, struct fifo_element *samples, size_t max, int timeout_ms);
+
+// Samples lost because they were read too late, since the device was opened
+unsigned long long adxl345_overruns(struct adxl345_dev *dev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
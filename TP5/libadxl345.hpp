@@ -0,0 +1,112 @@
+// C++ interface of the adxl345 client library (TP5)
+// A thin RAII wrapper over libadxl345.h: errors are thrown as std::system_error, the device is
+// closed with the object.
+#ifndef LIBADXL345_HPP
+#define LIBADXL345_HPP
+
+#include <array>
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "libadxl345.h"
+
+namespace adxl345 {
+
+using Sample = fifo_element;
+using Config = adxl345_config;
+
+inline void check(int ret, const char *what)
+{
+    if (ret < 0)
+        throw std::system_error(-ret, std::generic_category(), what);
+}
+
+// Paths of the accelerometers present, /dev/adxl345-N in increasing N
+inline std::vector<std::string> list()
+{
+    std::vector<std::array<char, ADXL345_PATH_MAX>> paths(16);
+    std::vector<std::string> result;
+    int n;
+
+    for (;;) {
+        n = adxl345_list(reinterpret_cast<char (*)[ADXL345_PATH_MAX]>(paths.data()), static_cast<int>(paths.size()));
+        check(n, "adxl345_list");
+        if (static_cast<size_t>(n) <= paths.size())
+            break;
+        paths.resize(n);
+    }
+    for (int i = 0; i < n; i++)
+        result.emplace_back(paths[i].data());
+    return result;
+}
+
+class Device {
+public:
+    // The first accelerometer when path is empty
+    explicit Device(const std::string &path = std::string(), bool mmap = false)
+        : dev_(adxl345_open(path.empty() ? nullptr : path.c_str(), mmap ? ADXL345_OPEN_MMAP : 0))
+    {
+        if (!dev_)
+            throw std::system_error(errno, std::generic_category(), "adxl345_open");
+    }
+
+    Device(Device &&other) noexcept : dev_(std::exchange(other.dev_, nullptr)) {}
+    Device &operator=(Device &&other) noexcept
+    {
+        std::swap(dev_, other.dev_);
+        return *this;
+    }
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+
+    ~Device() { adxl345_close(dev_); }
+
+    int fd() const { return adxl345_fd(dev_); }
+
+    Config config() const
+    {
+        Config cfg;
+        check(adxl345_get_config(dev_, &cfg), "adxl345_get_config");
+        return cfg;
+    }
+    void set_config(const Config &cfg) { check(adxl345_set_config(dev_, &cfg), "adxl345_set_config"); }
+    void set_latency(unsigned int latency_us) { check(adxl345_set_latency(dev_, latency_us), "adxl345_set_latency"); }
+    void set_lowat(unsigned int lowat) { check(adxl345_set_lowat(dev_, lowat), "adxl345_set_lowat"); }
+
+    std::array<signed char, 3> calibrate(unsigned int samples)
+    {
+        std::array<signed char, 3> offset{};
+        check(adxl345_calibrate(dev_, samples, offset.data()), "adxl345_calibrate");
+        return offset;
+    }
+
+    // Up to max samples into samples, waiting at most timeout_ms (-1: forever, 0: not at all)
+    size_t read(Sample *samples, size_t max, int timeout_ms = -1)
+    {
+        ssize_t n = adxl345_read_samples(dev_, samples, max, timeout_ms);
+        check(static_cast<int>(n < 0 ? n : 0), "adxl345_read_samples");
+        return static_cast<size_t>(n);
+    }
+
+    // Fills batch up to its capacity, it is resized to what was read
+    size_t read(std::vector<Sample> &batch, int timeout_ms = -1)
+    {
+        batch.resize(batch.capacity());
+        batch.resize(read(batch.data(), batch.size(), timeout_ms));
+        return batch.size();
+    }
+
+    unsigned long long overruns() const { return adxl345_overruns(dev_); }
+
+    adxl345_dev *get() const { return dev_; }
+
+private:
+    adxl345_dev *dev_;
+};
+
+} // namespace adxl345
+
+#endif
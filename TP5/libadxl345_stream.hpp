@@ -0,0 +1,242 @@
+// Typed sample streams of the adxl345 client library (TP5), header-only, C++17
+// A Stream reads batches of records from a Device and decodes them into the axes and the unit the
+// processing code wants, both chosen at compile time: no per-sample branch on the axis or the unit.
+// A batch holds one array per selected axis plus one of timestamps, so that the decode loop of each
+// axis, and the processing code going over one axis, are plain loops the compiler can vectorise.
+//   adxl345::Device dev;
+//   adxl345::Stream<ADXL345_AXIS_X | ADXL345_AXIS_Z, adxl345::G> stream(dev, 64);
+//   for (const auto &batch : stream)
+//       filter(batch.axis(0), batch.axis(1), batch.timestamps(), batch.size());
+// or one sample at a time:
+//       for (const auto &s : batch)
+//           process(s[0], s[1], s.timestamp);
+#ifndef LIBADXL345_STREAM_HPP
+#define LIBADXL345_STREAM_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include "libadxl345.hpp"
+
+namespace adxl345 {
+
+// Output units. scale() turns the resolution of the device, in 0.1 mg/LSB, into what convert() uses.
+
+// Raw LSB, as the driver gives them
+struct Raw {
+    using value_type = std::int16_t;
+    using scale_type = int;
+    static scale_type scale(int) { return 0; }
+    static value_type convert(std::int16_t v, scale_type) { return v; }
+};
+
+// mg, through a Q16 fixed-point factor
+// v * q16 overflows 32 bits for the larger samples a calibration gain can give, so the factor is
+// applied in two halves: v * (q16 >> 16) is small, v * (q16 & 0xFFFF) fits for any 16-bit v. The sum
+// is exactly (v * q16) >> 16, with 32-bit multiplies only, which SSE2 can vectorise.
+struct MilliG {
+    using value_type = std::int32_t;
+    using scale_type = std::int32_t;
+    static scale_type scale(int mg_x10) { return static_cast<scale_type>((static_cast<std::int64_t>(mg_x10) << 16) / 10); }
+    static value_type convert(std::int16_t v, scale_type q16)
+    {
+        return v * (q16 >> 16) + ((v * (q16 & 0xFFFF)) >> 16);
+    }
+};
+
+// g, in single precision
+struct G {
+    using value_type = float;
+    using scale_type = float;
+    static scale_type scale(int mg_x10) { return mg_x10 / 10000.0f; }
+    static value_type convert(std::int16_t v, scale_type g) { return v * g; }
+};
+
+// Resolution of the records in 0.1 mg/LSB for a configuration: 3.9 mg/LSB in full resolution,
+// doubled by each range step otherwise. 10 when the driver converts to mg itself (calib_mg).
+inline int mg_x10(const Config &cfg)
+{
+    int shift = 0;
+
+    if (!cfg.full_res)
+        for (unsigned int g = 2; g < cfg.range_g; g <<= 1)
+            shift++;
+    return 39 << shift;
+}
+
+template <unsigned int Axes, class Unit = Raw>
+class Stream {
+    static_assert(Axes != 0 && (Axes & ~ADXL345_AXIS_ALL) == 0, "Axes: ADXL345_AXIS_* ored together");
+
+public:
+    using value_type = typename Unit::value_type;
+
+    static constexpr std::size_t channels =
+        !!(Axes & ADXL345_AXIS_X) + !!(Axes & ADXL345_AXIS_Y) + !!(Axes & ADXL345_AXIS_Z);
+
+    // One sample gathered from the arrays of a batch: the selected axes in X, Y, Z order, and the
+    // CLOCK_BOOTTIME of the acquisition in ns
+    struct Sample {
+        std::array<value_type, channels> v;
+        std::uint64_t timestamp;
+
+        value_type operator[](std::size_t i) const { return v[i]; }
+    };
+
+    class Batch {
+    public:
+        // Values of the k-th selected axis, in X, Y, Z order, and the timestamps, size() of each
+        const value_type *axis(std::size_t k) const { return stream_->axes_[k].data(); }
+        const std::uint64_t *timestamps() const { return stream_->timestamps_.data(); }
+        std::size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+        Sample operator[](std::size_t i) const
+        {
+            Sample s;
+
+            for (std::size_t k = 0; k < channels; k++)
+                s.v[k] = stream_->axes_[k][i];
+            s.timestamp = stream_->timestamps_[i];
+            return s;
+        }
+
+        class iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = Sample;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = Sample;
+
+            iterator(const Batch *batch, std::size_t i) : batch_(batch), i_(i) {}
+
+            Sample operator*() const { return (*batch_)[i_]; }
+            iterator &operator++()
+            {
+                i_++;
+                return *this;
+            }
+            bool operator==(const iterator &other) const { return i_ == other.i_; }
+            bool operator!=(const iterator &other) const { return i_ != other.i_; }
+
+        private:
+            const Batch *batch_;
+            std::size_t i_;
+        };
+
+        iterator begin() const { return iterator(this, 0); }
+        iterator end() const { return iterator(this, size_); }
+
+    private:
+        friend class Stream;
+        const Stream *stream_ = nullptr;
+        std::size_t size_ = 0;
+    };
+
+    // Batches of up to batch_size samples, each waiting at most timeout_ms (-1: forever).
+    // The resolution comes from the configuration of the device unless mg_x10 is given,
+    // e.g. 10 when /sys/class/misc/adxl345-N/calib_mg is 1.
+    explicit Stream(Device &dev, std::size_t batch_size = 64, int timeout_ms = -1, int mg_x10 = 0)
+        : dev_(dev), timeout_ms_(timeout_ms), raw_(batch_size ? batch_size : 1), timestamps_(raw_.size())
+    {
+        for (auto &axis : axes_)
+            axis.resize(raw_.size());
+        batch_.stream_ = this;
+        rescale(mg_x10);
+    }
+
+    // The batch points back to its stream
+    Stream(const Stream &) = delete;
+    Stream &operator=(const Stream &) = delete;
+
+    // To call after changing the range or the resolution of the device
+    void rescale(int mg_x10 = 0) { scale_ = Unit::scale(mg_x10 ? mg_x10 : adxl345::mg_x10(dev_.config())); }
+
+    // Next batch, empty on timeout. Valid until the next call.
+    const Batch &next()
+    {
+        std::size_t n = dev_.read(raw_.data(), raw_.size(), timeout_ms_);
+
+        decode<ADXL345_AXIS_X>(n);
+        decode<ADXL345_AXIS_Y>(n);
+        decode<ADXL345_AXIS_Z>(n);
+        for (std::size_t i = 0; i < n; i++)
+            timestamps_[i] = raw_[i].timestamp;
+
+        batch_.size_ = n;
+        return batch_;
+    }
+
+    // Range-based for over the batches, until one times out
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Batch;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Batch *;
+        using reference = const Batch &;
+
+        iterator() = default;
+        explicit iterator(Stream *stream) : stream_(stream) { ++*this; }
+
+        reference operator*() const { return stream_->batch_; }
+        pointer operator->() const { return &stream_->batch_; }
+        iterator &operator++()
+        {
+            if (stream_->next().empty())
+                stream_ = nullptr;
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return stream_ == other.stream_; }
+        bool operator!=(const iterator &other) const { return stream_ != other.stream_; }
+
+    private:
+        Stream *stream_ = nullptr;
+    };
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+private:
+    template <unsigned int Axis>
+    static std::int16_t pick(const fifo_element &e)
+    {
+        if constexpr (Axis == ADXL345_AXIS_X)
+            return e.x;
+        else if constexpr (Axis == ADXL345_AXIS_Y)
+            return e.y;
+        else
+            return e.z;
+    }
+
+    // One loop per selected axis, into its own array: Axis and its index are constants
+    template <unsigned int Axis>
+    void decode(std::size_t n)
+    {
+        if constexpr ((Axes & Axis) != 0) {
+            constexpr std::size_t k = !!(Axes & (Axis - 1) & ADXL345_AXIS_X) + !!(Axes & (Axis - 1) & ADXL345_AXIS_Y);
+            const fifo_element *in = raw_.data();
+            value_type *out = axes_[k].data();
+            const typename Unit::scale_type scale = scale_;
+
+            for (std::size_t i = 0; i < n; i++)
+                out[i] = Unit::convert(pick<Axis>(in[i]), scale);
+        }
+    }
+
+    Device &dev_;
+    int timeout_ms_;
+    typename Unit::scale_type scale_;
+    std::vector<fifo_element> raw_;
+    std::array<std::vector<value_type>, channels> axes_;
+    std::vector<std::uint64_t> timestamps_;
+    Batch batch_;
+};
+
+} // namespace adxl345
+
+#endif